@@ -0,0 +1,439 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "engine.h"
+
+
+namespace engine {
+    // Читает строки из файла большими кусками, без копирования каждой строки
+    class LineReader {
+    public:
+        explicit LineReader(FILE *file, size_t buffer_size = 1 << 20) : buffer(buffer_size) {
+            this->file = file;
+        }
+
+        /*
+         * Выдает очередную строку без перевода строки.
+         * Строка живет до следующего вызова next()
+         * */
+        bool next(std::string_view &line) {
+            while (true) {
+                auto *start = buffer.data() + begin;
+                auto *newline = static_cast<char *>(std::memchr(start, '\n', end - begin));
+                if (newline != nullptr) {
+                    line = trim(std::string_view(start, newline - start));
+                    begin = newline - buffer.data() + 1;
+                    return true;
+                }
+
+                if (finished) {
+                    if (begin == end)
+                        return false;
+                    line = trim(std::string_view(start, end - begin));
+                    begin = end;
+                    return true;
+                }
+
+                fill();
+            }
+        }
+
+    private:
+        FILE *file;
+        std::vector<char> buffer;
+        size_t begin = 0;
+        size_t end = 0;
+        bool finished = false;
+
+        static std::string_view trim(std::string_view line) {
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            return line;
+        }
+
+        void fill() {
+            // недочитанный хвост переносим в начало буфера
+            std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+
+            // строка длиннее буфера
+            if (end == buffer.size())
+                buffer.resize(buffer.size() * 2);
+
+            size_t read = std::fread(buffer.data() + end, 1, buffer.size() - end, file);
+            end += read;
+            if (read == 0)
+                finished = true;
+        }
+    };
+
+    // Печатает число так же, как std::cout << value
+    inline std::string_view format_number(double value, char (&text)[32]) {
+        auto result = std::to_chars(text, text + sizeof(text), value, std::chars_format::general, 6);
+        return std::string_view(text, result.ptr - text);
+    }
+
+    // Буферизованный вывод ответов в файл
+    class OutputBuffer {
+    public:
+        explicit OutputBuffer(FILE *file, size_t capacity = 1 << 16) : buffer(capacity) {
+            this->file = file;
+        }
+
+        OutputBuffer(const OutputBuffer &) = delete;
+        OutputBuffer &operator=(const OutputBuffer &) = delete;
+
+        ~OutputBuffer() {
+            flush();
+        }
+
+        void write(std::string_view text) {
+            if (size + text.size() > buffer.size()) {
+                flush();
+                if (text.size() > buffer.size()) {
+                    std::fwrite(text.data(), 1, text.size(), file);
+                    return;
+                }
+            }
+            std::memcpy(buffer.data() + size, text.data(), text.size());
+            size += text.size();
+        }
+
+        void write(double value) {
+            char text[32];
+            write(format_number(value, text));
+        }
+
+        void flush() {
+            if (size > 0)
+                std::fwrite(buffer.data(), 1, size, file);
+            size = 0;
+        }
+
+    private:
+        FILE *file;
+        std::vector<char> buffer;
+        size_t size = 0;
+    };
+
+    // Вывод ответов в память, чтобы потом записать их в нужном порядке
+    class StringOutput {
+    public:
+        std::string text;
+
+        void write(std::string_view part) {
+            text.append(part);
+        }
+
+        void write(double value) {
+            char number[32];
+            text.append(format_number(value, number));
+        }
+    };
+
+    /*
+     * Считает выражения по одному на строку.
+     * Токенайзер, парсер и арена одни на все строки,
+     * поэтому на строку не приходится ни одной аллокации
+     * */
+    class BatchEvaluator {
+    public:
+        Tokenizer tokenizer;
+        Parser parser;
+        Arena arena;
+
+        BatchEvaluator() : parser(&tokenizer) {}
+
+        BatchEvaluator(const BatchEvaluator &) = delete;
+        BatchEvaluator &operator=(const BatchEvaluator &) = delete;
+
+        // Пишет ответ или текст ошибки отдельной строкой
+        template<typename Output>
+        void evaluate(std::string_view line, Output &output) {
+            arena.reset();
+            try {
+                tokenizer.set_input(line);
+                parser.parse_expression(arena);
+                // значений переменных в пакете нет, NaN вместо ответа был бы молчаливой ошибкой
+                if (parser.uses_variables)
+                    throw std::logic_error("Variable has no value: " + parser.variables.front());
+                output.write(parser.answer);
+            } catch (const std::exception &error) {
+                output.write("error: ");
+                output.write(error.what());
+            }
+            output.write("\n");
+
+            // в пакете значения переменных неоткуда взять, слоты копить незачем
+            if (!parser.variables.empty())
+                parser.clear_variables();
+        }
+    };
+
+    // Считает все строки текста, последний перевод строки не дает пустой строки
+    template<typename Output>
+    size_t evaluate_lines(BatchEvaluator &evaluator, std::string_view text, Output &output) {
+        size_t lines = 0;
+        while (!text.empty()) {
+            size_t newline = text.find('\n');
+            std::string_view line = text.substr(0, newline);
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+
+            evaluator.evaluate(line, output);
+            lines++;
+            text = newline == std::string_view::npos ? std::string_view() : text.substr(newline + 1);
+        }
+        return lines;
+    }
+
+    // Считает строки текста, который уже лежит в памяти (например, отображенного файла)
+    inline size_t run_batch(std::string_view input, FILE *output) {
+        OutputBuffer buffer(output);
+        BatchEvaluator evaluator;
+        return evaluate_lines(evaluator, input, buffer);
+    }
+
+    // Считает все строки из input и пишет ответы в output, возвращает число строк
+    inline size_t run_batch(FILE *input, FILE *output) {
+        LineReader reader(input);
+        OutputBuffer buffer(output);
+        BatchEvaluator evaluator;
+
+        size_t lines = 0;
+        std::string_view line;
+        while (reader.next(line)) {
+            evaluator.evaluate(line, buffer);
+            lines++;
+        }
+        return lines;
+    }
+
+    // Пул потоков, задача получает номер потока, чтобы брать его собственные объекты
+    class ThreadPool {
+    public:
+        explicit ThreadPool(size_t threads) {
+            for (size_t worker = 0; worker < threads; worker++)
+                workers.emplace_back([this, worker] { run(worker); });
+        }
+
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto &worker : workers)
+                worker.join();
+        }
+
+        size_t size() const {
+            return workers.size();
+        }
+
+        void submit(std::function<void(size_t worker)> task) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                tasks.push_back(std::move(task));
+            }
+            wake.notify_one();
+        }
+
+    private:
+        std::vector<std::thread> workers;
+        std::deque<std::function<void(size_t)>> tasks;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping = false;
+
+        void run(size_t worker) {
+            while (true) {
+                std::function<void(size_t)> task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+                    if (tasks.empty())
+                        return;
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                task(worker);
+            }
+        }
+    };
+
+    /*
+     * Кусок входа из целых строк и ответы на них.
+     * text смотрит либо в storage, либо в чужую память
+     * */
+    struct BatchChunk {
+        std::vector<char> storage;
+        std::string_view text;
+        StringOutput output;
+        size_t lines = 0;
+        bool done = false;
+    };
+
+    /*
+     * Параллельный пакетный режим: вход режется на куски по целым строкам,
+     * куски считаются в пуле потоков (у каждого потока свой BatchEvaluator),
+     * а ответы пишутся в исходном порядке.
+     * next_chunk(chunk) заполняет chunk.text и возвращает false, когда вход кончился
+     * */
+    template<typename ChunkSource>
+    size_t run_parallel_batch(ChunkSource next_chunk, FILE *output, size_t threads) {
+        if (threads == 0)
+            threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+
+        std::vector<std::unique_ptr<BatchEvaluator>> evaluators;
+        for (size_t i = 0; i < threads; i++)
+            evaluators.push_back(std::make_unique<BatchEvaluator>());
+
+        // одновременно в работе не больше нескольких кусков на поток, чтобы не съесть память
+        std::vector<BatchChunk> chunks(threads * 4);
+        std::mutex mutex;
+        std::condition_variable finished;
+
+        ThreadPool pool(threads);
+        size_t submitted = 0;
+        size_t written = 0;
+        size_t lines = 0;
+        bool input_finished = false;
+
+        while (true) {
+            while (!input_finished && submitted - written < chunks.size()) {
+                auto &chunk = chunks[submitted % chunks.size()];
+                chunk.output.text.clear();
+                chunk.lines = 0;
+                chunk.done = false;
+                if (!next_chunk(chunk)) {
+                    input_finished = true;
+                    break;
+                }
+
+                pool.submit([&chunk, &evaluators, &mutex, &finished](size_t worker) {
+                    chunk.lines = evaluate_lines(*evaluators[worker], chunk.text, chunk.output);
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    chunk.done = true;
+                    finished.notify_all();
+                });
+                submitted++;
+            }
+
+            if (written == submitted)
+                break;
+
+            auto &chunk = chunks[written % chunks.size()];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                finished.wait(lock, [&chunk] { return chunk.done; });
+            }
+            std::fwrite(chunk.output.text.data(), 1, chunk.output.text.size(), output);
+            lines += chunk.lines;
+            written++;
+        }
+        return lines;
+    }
+
+    // Режет файл на куски примерно по chunk_size байт, не разрывая строк
+    class FileChunkReader {
+    public:
+        explicit FileChunkReader(FILE *file, size_t chunk_size = 1 << 20) {
+            this->file = file;
+            this->chunk_size = chunk_size;
+        }
+
+        bool operator()(BatchChunk &chunk) {
+            auto &storage = chunk.storage;
+            storage.assign(carry.begin(), carry.end());
+            carry.clear();
+
+            while (!finished) {
+                size_t size = storage.size();
+                storage.resize(size + chunk_size);
+                size_t read = std::fread(storage.data() + size, 1, chunk_size, file);
+                storage.resize(size + read);
+                if (read == 0) {
+                    finished = true;
+                    break;
+                }
+
+                // хвост после последнего перевода строки уходит в следующий кусок
+                size_t newline = std::string_view(storage.data() + size, read).rfind('\n');
+                if (newline != std::string_view::npos) {
+                    newline += size + 1;
+                    carry.assign(storage.begin() + newline, storage.end());
+                    storage.resize(newline);
+                    break;
+                }
+            }
+
+            if (storage.empty() && finished)
+                return false;
+            chunk.text = std::string_view(storage.data(), storage.size());
+            return true;
+        }
+
+    private:
+        FILE *file;
+        size_t chunk_size;
+        std::vector<char> carry;
+        bool finished = false;
+    };
+
+    // Режет текст в памяти на куски без копирования
+    class ViewChunkReader {
+    public:
+        explicit ViewChunkReader(std::string_view text, size_t chunk_size = 1 << 20) {
+            this->rest = text;
+            this->chunk_size = chunk_size;
+        }
+
+        bool operator()(BatchChunk &chunk) {
+            if (rest.empty())
+                return false;
+
+            size_t end = rest.size();
+            if (end > chunk_size) {
+                size_t newline = rest.find('\n', chunk_size);
+                if (newline != std::string_view::npos)
+                    end = newline + 1;
+            }
+
+            chunk.text = rest.substr(0, end);
+            rest.remove_prefix(end);
+            return true;
+        }
+
+    private:
+        std::string_view rest;
+        size_t chunk_size;
+    };
+
+    inline size_t run_parallel_batch(FILE *input, FILE *output, size_t threads) {
+        return run_parallel_batch(FileChunkReader(input), output, threads);
+    }
+
+    inline size_t run_parallel_batch(std::string_view input, FILE *output, size_t threads) {
+        return run_parallel_batch(ViewChunkReader(input), output, threads);
+    }
+}
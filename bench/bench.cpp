@@ -0,0 +1,350 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "engine.h"
+#include "incremental.h"
+#include "jit.h"
+#include "optimize.h"
+#include "program.h"
+
+/*
+ * Микробенчмарки токенайзера, парсера и вычисления в духе Google Benchmark:
+ * каждый замер крутится, пока не наберет достаточно времени,
+ * и печатает время на итерацию и на токен/ноду.
+ * bench [фильтр] - запускает только замеры, в имени которых есть фильтр
+ * */
+
+// Считаем все обращения к operator new, чтобы знать аллокации на разбор
+static std::atomic<size_t> heap_allocations{0};
+
+void *operator new(size_t size) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *memory = std::malloc(size == 0 ? 1 : size))
+        return memory;
+    throw std::bad_alloc();
+}
+
+/*
+ * free() на указателе из operator new - законная пара, но если delete встроится
+ * в вызывающий код, GCC увидит ее и предупредит (-Wmismatched-new-delete)
+ * */
+[[gnu::noinline]] void operator delete(void *memory) noexcept {
+    std::free(memory);
+}
+
+[[gnu::noinline]] void operator delete(void *memory, size_t) noexcept {
+    std::free(memory);
+}
+
+// массивы тоже через malloc/free, чтобы пары new[]/delete[] не уходили в стандартный аллокатор
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+[[gnu::noinline]] void operator delete[](void *memory) noexcept {
+    std::free(memory);
+}
+
+[[gnu::noinline]] void operator delete[](void *memory, size_t) noexcept {
+    std::free(memory);
+}
+
+namespace {
+    struct State {
+        size_t iterations = 0;
+        // на что делить время итерации
+        double tokens = 0;
+        double nodes = 0;
+        // аллокаций за все итерации
+        double allocations = -1;
+    };
+
+    struct Benchmark {
+        std::string name;
+        std::function<void(State &)> run;
+    };
+
+    struct Workload {
+        std::string name;
+        std::string input;
+    };
+
+    // 1+2+3+...: длинная плоская сумма, левое дерево
+    std::string flat_sum(size_t terms) {
+        std::string input = "1";
+        for (size_t i = 2; i <= terms; i++)
+            input += "+" + std::to_string(i % 100);
+        return input;
+    }
+
+    // ((((1+1)*2-3)/4...): глубоко вложенные скобки
+    std::string nested_parentheses(size_t depth) {
+        const char operators[] = {'+', '*', '-', '/'};
+        std::string input(depth, '(');
+        input += "1";
+        for (size_t i = 0; i < depth; i++) {
+            input += operators[i % 4];
+            input += std::to_string(i % 9 + 1) + ")";
+        }
+        return input;
+    }
+
+    // длинные дробные числа, основное время уходит на их разбор
+    std::string numeric_heavy(size_t terms) {
+        std::string input = "123456.789012";
+        for (size_t i = 0; i < terms; i++)
+            input += (i % 2 ? "*" : "+") + std::to_string(1000000 + i * 7919) + "." + std::to_string(100000 + i);
+        return input;
+    }
+
+    // 1.5^2+2.5^3*...: степени с постоянным показателем, которые считаются без pow
+    std::string powers(size_t terms) {
+        const char *exponents[] = {"2", "3", "0.5", "5", "-2", "1.7"};
+        std::string input = "1";
+        for (size_t i = 0; i < terms; i++)
+            input += (i % 2 ? "*" : "+") + std::to_string(i % 7 + 1) + ".5^" + exponents[i % 6];
+        return input;
+    }
+
+    // (a*b-c)*(a*b-c)/(a*b-c)+...: сгенерированная формула с повторяющимися подвыражениями
+    std::string repeated(size_t terms) {
+        std::string input = "1";
+        for (size_t i = 0; i < terms; i++) {
+            std::string common = "(" + std::to_string(i % 5 + 1) + ".5*" + std::to_string(i % 3 + 2) + ".5-1.25)";
+            input += "+" + common + "*" + common + "/" + common;
+        }
+        return input;
+    }
+
+    size_t count_tokens(const std::string &input) {
+        engine::Tokenizer tokenizer;
+        tokenizer.set_input(input);
+        size_t tokens = 1;
+        while (tokenizer.current_token != engine::eof) {
+            tokenizer.next_token();
+            tokens++;
+        }
+        return tokens;
+    }
+
+    std::vector<Benchmark> make_benchmarks() {
+        std::vector<Workload> workloads = {
+                {"flat_sum/10000",           flat_sum(10000)},
+                {"nested_parentheses/1000",  nested_parentheses(1000)},
+                {"numeric_heavy/2000",       numeric_heavy(2000)},
+                {"powers/2000",              powers(2000)},
+                {"repeated/1000",            repeated(1000)},
+        };
+
+        std::vector<Benchmark> benchmarks;
+        for (const auto &workload : workloads) {
+            const std::string input = workload.input;
+            double tokens = (double) count_tokens(input);
+
+            engine::Tokenizer tokenizer;
+            engine::Parser parser(&tokenizer);
+            tokenizer.set_input(input);
+            auto expression = std::make_shared<engine::Expression>(parser.parse_expression());
+            double nodes = (double) engine::count_nodes(expression->root);
+
+            benchmarks.push_back({"tokenize/" + workload.name, [input, tokens](State &state) {
+                engine::Tokenizer tokenizer;
+                for (size_t i = 0; i < state.iterations; i++) {
+                    tokenizer.set_input(input);
+                    while (tokenizer.current_token != engine::eof)
+                        tokenizer.next_token();
+                }
+                state.tokens = tokens;
+            }});
+
+            // свежая арена на каждый разбор, как у parse_expression()
+            benchmarks.push_back({"parse/" + workload.name, [input, tokens, nodes](State &state) {
+                engine::Tokenizer tokenizer;
+                engine::Parser parser(&tokenizer);
+                size_t allocations = 0;
+                size_t before = heap_allocations.load();
+                for (size_t i = 0; i < state.iterations; i++) {
+                    tokenizer.set_input(input);
+                    auto expression = parser.parse_expression();
+                    allocations += expression.arena.allocations;
+                }
+                state.tokens = tokens;
+                state.nodes = nodes;
+                state.allocations = double(allocations + heap_allocations.load() - before);
+            }});
+
+            // одна арена на все разборы, как в пакетном режиме
+            benchmarks.push_back({"parse_reuse/" + workload.name, [input, tokens, nodes](State &state) {
+                engine::Tokenizer tokenizer;
+                engine::Parser parser(&tokenizer);
+                engine::Arena arena;
+                tokenizer.set_input(input);
+                parser.parse_expression(arena);
+
+                size_t arena_before = arena.allocations;
+                size_t before = heap_allocations.load();
+                for (size_t i = 0; i < state.iterations; i++) {
+                    arena.reset();
+                    tokenizer.set_input(input);
+                    parser.parse_expression(arena);
+                }
+                state.tokens = tokens;
+                state.nodes = nodes;
+                state.allocations = double(arena.allocations - arena_before + heap_allocations.load() - before);
+            }});
+
+            // правка одной цифры в середине текста, как нажатие клавиши в редакторе
+            size_t digit = input.find_first_of("0123456789", input.size() / 2);
+            benchmarks.push_back({"reparse_edit/" + workload.name, [input, digit](State &state) {
+                engine::Tokenizer tokenizer;
+                engine::Parser parser(&tokenizer);
+                engine::IncrementalParser incremental(&parser);
+                incremental.set_text(input);
+
+                const char original = input[digit];
+                const char replacement[] = {original == '7' ? '8' : '7', '\0'};
+                const char restored[] = {original, '\0'};
+                for (size_t i = 0; i < state.iterations; i++)
+                    incremental.edit(digit, 1, i % 2 == 0 ? replacement : restored);
+            }});
+
+            // одинаковые поддеревья собираются в одну ноду прямо при разборе
+            benchmarks.push_back({"parse_interned/" + workload.name, [input, tokens, nodes](State &state) {
+                engine::Tokenizer tokenizer;
+                engine::Parser parser(&tokenizer);
+                parser.intern_nodes = true;
+                engine::Arena arena;
+                tokenizer.set_input(input);
+                parser.parse_expression(arena);
+
+                size_t arena_before = arena.allocations;
+                size_t before = heap_allocations.load();
+                for (size_t i = 0; i < state.iterations; i++) {
+                    arena.reset();
+                    tokenizer.set_input(input);
+                    parser.parse_expression(arena);
+                }
+                state.tokens = tokens;
+                state.nodes = nodes;
+                state.allocations = double(arena.allocations - arena_before + heap_allocations.load() - before);
+            }});
+
+            benchmarks.push_back({"eval_tree/" + workload.name, [expression, nodes](State &state) {
+                volatile double sink = 0;
+                for (size_t i = 0; i < state.iterations; i++)
+                    sink = sink + expression->eval();
+                state.nodes = nodes;
+            }});
+
+            // рекурсивный виртуальный eval() для сравнения с Evaluator
+            benchmarks.push_back({"eval_recursive/" + workload.name, [expression, nodes](State &state) {
+                volatile double sink = 0;
+                for (size_t i = 0; i < state.iterations; i++)
+                    sink = sink + expression->root->eval(nullptr);
+                state.nodes = nodes;
+            }});
+
+            auto program = std::make_shared<engine::Program>(*expression);
+            benchmarks.push_back({"eval_program/" + workload.name, [program, nodes](State &state) {
+                volatile double sink = 0;
+                for (size_t i = 0; i < state.iterations; i++)
+                    sink = sink + program->eval();
+                state.nodes = nodes;
+            }});
+
+            // общие подвыражения считаются один раз; ns/node - на ноду исходного дерева
+            tokenizer.set_input(input);
+            engine::Expression shared = parser.parse_expression();
+            engine::share_subexpressions(shared);
+            auto shared_program = std::make_shared<engine::Program>(shared);
+            benchmarks.push_back({"eval_shared_program/" + workload.name, [shared_program, nodes](State &state) {
+                volatile double sink = 0;
+                for (size_t i = 0; i < state.iterations; i++)
+                    sink = sink + shared_program->eval();
+                state.nodes = nodes;
+            }});
+
+            auto jit = std::make_shared<engine::JitFunction>(*expression);
+            benchmarks.push_back({"eval_jit/" + workload.name, [jit, nodes](State &state) {
+                volatile double sink = 0;
+                for (size_t i = 0; i < state.iterations; i++)
+                    sink = sink + jit->eval();
+                state.nodes = nodes;
+            }});
+        }
+
+        // длинная левая цепочка сложений: рекурсивный eval() здесь переполнял стек
+        auto chain = std::make_shared<engine::Expression>();
+        {
+            engine::Tokenizer tokenizer;
+            engine::Parser parser(&tokenizer);
+            const std::string input = flat_sum(1000000);
+            tokenizer.set_input(input);
+            *chain = parser.parse_expression();
+        }
+        double chain_nodes = 2 * 1000000 - 1;
+        benchmarks.push_back({"eval_deep/flat_sum/1000000", [chain, chain_nodes](State &state) {
+            volatile double sink = 0;
+            for (size_t i = 0; i < state.iterations; i++)
+                sink = sink + chain->eval();
+            state.nodes = chain_nodes;
+        }});
+
+        auto chain_program = std::make_shared<engine::Program>(*chain);
+        benchmarks.push_back({"eval_deep_program/flat_sum/1000000", [chain_program, chain_nodes](State &state) {
+            volatile double sink = 0;
+            for (size_t i = 0; i < state.iterations; i++)
+                sink = sink + chain_program->eval();
+            state.nodes = chain_nodes;
+        }});
+        return benchmarks;
+    }
+
+    // Удваивает число итераций, пока замер не займет хотя бы min_time секунд
+    void run(const Benchmark &benchmark, double min_time) {
+        State state;
+        double elapsed = 0;
+        for (size_t iterations = 1;; iterations *= 2) {
+            state = State();
+            state.iterations = iterations;
+
+            auto start = std::chrono::steady_clock::now();
+            benchmark.run(state);
+            auto finish = std::chrono::steady_clock::now();
+
+            elapsed = std::chrono::duration<double, std::nano>(finish - start).count();
+            if (elapsed >= min_time * 1e9 || iterations >= (1u << 30))
+                break;
+        }
+
+        double per_iteration = elapsed / double(state.iterations);
+        std::printf("%-40s %14.0f ns %10zu", benchmark.name.c_str(), per_iteration, state.iterations);
+        if (state.tokens > 0)
+            std::printf("   %7.2f ns/token", per_iteration / state.tokens);
+        if (state.nodes > 0)
+            std::printf("   %7.2f ns/node", per_iteration / state.nodes);
+        if (state.allocations >= 0)
+            std::printf("   %7.2f allocs/parse", state.allocations / double(state.iterations));
+        std::printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *filter = argc > 1 ? argv[1] : "";
+    double min_time = argc > 2 ? std::stod(argv[2]) : 0.2;
+
+    std::printf("%-40s %17s %10s\n", "Benchmark", "Time", "Iterations");
+    for (const auto &benchmark : make_benchmarks()) {
+        if (std::strstr(benchmark.name.c_str(), filter) != nullptr)
+            run(benchmark, min_time);
+    }
+    return 0;
+}
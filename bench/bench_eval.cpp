@@ -0,0 +1,156 @@
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+
+#include "engine.h"
+#include "program.h"
+#include "jit.h"
+
+/*
+ * Сравнение стоимости вычисления одной ноды:
+ * старые ноды с std::function против нод с токеном операции
+ * и против байткода engine::Program и машинного кода engine::JitFunction
+ * */
+namespace legacy {
+    class Node {
+    public:
+        virtual double eval() = 0;
+    };
+
+    class NumberNode : public Node {
+    public:
+        double number;
+
+        explicit NumberNode(double number) : number(number) {}
+
+        double eval() override {
+            return number;
+        }
+    };
+
+    class BinaryOperationNode : public Node {
+    public:
+        Node *left_leaf;
+        Node *right_leaf;
+        std::function<double(double, double)> operation;
+
+        BinaryOperationNode(Node *left_leaf, Node *right_leaf, std::function<double(double, double)> operation)
+                : left_leaf(left_leaf), right_leaf(right_leaf), operation(std::move(operation)) {}
+
+        double eval() override {
+            auto left_leaf_value = left_leaf->eval();
+            auto right_leaf_value = right_leaf->eval();
+
+            return operation(left_leaf_value, right_leaf_value);
+        }
+    };
+
+    class UnaryOperationNode : public Node {
+    public:
+        Node *right_leaf;
+        std::function<double(double)> operation;
+
+        UnaryOperationNode(Node *right_leaf, std::function<double(double)> operation)
+                : right_leaf(right_leaf), operation(std::move(operation)) {}
+
+        double eval() override {
+            return operation(right_leaf->eval());
+        }
+    };
+
+    // Строит копию дерева engine на старых нодах
+    Node *convert(engine::Node *node, engine::Arena &arena, size_t &count) {
+        count++;
+        if (auto *number = dynamic_cast<engine::NumberNode *>(node))
+            return arena.make<NumberNode>(number->number);
+
+        if (auto *unary = dynamic_cast<engine::UnaryOperationNode *>(node)) {
+            auto *right = convert(unary->right_leaf, arena, count);
+            return arena.make<UnaryOperationNode>(right, [](double a) -> double { return -a; });
+        }
+
+        auto *binary = dynamic_cast<engine::BinaryOperationNode *>(node);
+        auto *left = convert(binary->left_leaf, arena, count);
+        auto *right = convert(binary->right_leaf, arena, count);
+
+        std::function<double(double, double)> operation;
+        switch (binary->operation) {
+            case engine::addition:
+                operation = [](double a, double b) -> double { return a + b; };
+                break;
+            case engine::subtraction:
+                operation = [](double a, double b) -> double { return a - b; };
+                break;
+            case engine::multiplication:
+                operation = [](double a, double b) -> double { return a * b; };
+                break;
+            default:
+                operation = [](double a, double b) -> double { return a / b; };
+                break;
+        }
+        return arena.make<BinaryOperationNode>(left, right, operation);
+    }
+}
+
+// Выражение вида 1.5+2.5*-3.5-4.5/5.5+... из terms слагаемых
+static std::string make_input(size_t terms) {
+    const char operators[] = {'+', '*', '-', '/'};
+    std::string input = "1.5";
+    for (size_t i = 0; i < terms; i++) {
+        input += operators[i % 4];
+        if (i % 7 == 0)
+            input += '-';
+        input += "(" + std::to_string(i % 10 + 1) + ".5+" + std::to_string(i % 3 + 1) + ")";
+    }
+    return input;
+}
+
+template<typename Function>
+static double measure(Function function, size_t repeats) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; i++)
+        function();
+    auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(finish - start).count();
+}
+
+int main(int argc, char *argv[]) {
+    size_t terms = argc > 1 ? std::stoul(argv[1]) : 1000;
+    size_t repeats = argc > 2 ? std::stoul(argv[2]) : 2000;
+
+    engine::Tokenizer tokenizer;
+    engine::Parser parser(&tokenizer);
+    std::string input = make_input(terms);
+    tokenizer.set_input(input);
+    auto expression = parser.parse_expression();
+
+    engine::Arena legacy_arena;
+    size_t nodes = 0;
+    legacy::Node *legacy_root = legacy::convert(expression.root, legacy_arena, nodes);
+
+    engine::Program program(expression.root);
+    engine::JitFunction jit(expression);
+
+    volatile double sink = 0;
+    // прогрев
+    measure([&] { sink = sink + legacy_root->eval() + expression.eval() + program.eval(); }, repeats / 10 + 1);
+
+    double before = measure([&] { sink = sink + legacy_root->eval(); }, repeats);
+    // виртуальный eval нод, рекурсивный
+    double after = measure([&] { sink = sink + expression.root->eval(nullptr); }, repeats);
+    // Evaluator с явным стеком, им считает Expression::eval
+    double iterative = measure([&] { sink = sink + expression.eval(); }, repeats);
+    double bytecode = measure([&] { sink = sink + program.eval(); }, repeats);
+    double native = measure([&] { sink = sink + jit.eval(); }, repeats);
+
+    std::printf("nodes: %zu, repeats: %zu\n", nodes, repeats);
+    std::printf("std::function nodes: %8.3f ns/node\n", before / double(nodes * repeats));
+    std::printf("opcode nodes:        %8.3f ns/node\n", after / double(nodes * repeats));
+    std::printf("speedup:             %8.2fx\n", before / after);
+    std::printf("explicit stack:      %8.3f ns/node\n", iterative / double(nodes * repeats));
+    std::printf("bytecode program:    %8.3f ns/node\n", bytecode / double(nodes * repeats));
+    std::printf("%s %8.3f ns/node\n", jit.is_native() ? "jit native code:    " : "jit (interpreted):  ",
+                native / double(nodes * repeats));
+    return 0;
+}
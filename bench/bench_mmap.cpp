@@ -0,0 +1,71 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "batch.h"
+#include "mapped_file.h"
+
+/*
+ * Пакетный режим: чтение через std::cin/getline, через fread
+ * и через отображенный в память файл
+ * */
+template<typename Function>
+static double measure(Function function) {
+    auto start = std::chrono::steady_clock::now();
+    function();
+    auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(finish - start).count();
+}
+
+static void report(const char *name, double seconds, size_t lines, size_t bytes) {
+    std::printf("%-10s %8.3f s %10.1f MB/s %10.2f M lines/s\n",
+                name, seconds, double(bytes) / seconds / 1e6, double(lines) / seconds / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    std::string path = argc > 1 ? argv[1] : "bench_mmap_input.txt";
+    size_t lines = argc > 2 ? std::stoul(argv[2]) : 5000000;
+
+    if (argc <= 1) {
+        std::ofstream file(path);
+        for (size_t i = 0; i < lines; i++)
+            file << i % 97 << ".5*(" << i % 13 << "+x" << i % 7 << ")-" << i % 11 << "/4\n";
+    }
+
+    FILE *null_output = std::fopen("/dev/null", "wb");
+    size_t bytes = engine::MappedFile(path).text().size();
+    size_t counted = 0;
+
+    double iostream_time = measure([&] {
+        std::ifstream input(path);
+        engine::OutputBuffer output(null_output);
+        engine::BatchEvaluator evaluator;
+        std::string line;
+        counted = 0;
+        while (std::getline(input, line)) {
+            evaluator.evaluate(line, output);
+            counted++;
+        }
+    });
+    report("iostream", iostream_time, counted, bytes);
+
+    double fread_time = measure([&] {
+        FILE *input = std::fopen(path.c_str(), "rb");
+        counted = engine::run_batch(input, null_output);
+        std::fclose(input);
+    });
+    report("fread", fread_time, counted, bytes);
+
+    double mmap_time = measure([&] {
+        engine::MappedFile file(path);
+        counted = engine::run_batch(file.text(), null_output);
+    });
+    report("mmap", mmap_time, counted, bytes);
+
+    std::fclose(null_output);
+    if (argc <= 1)
+        std::remove(path.c_str());
+    return 0;
+}
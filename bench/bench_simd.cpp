@@ -0,0 +1,68 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "engine.h"
+#include "program.h"
+
+/*
+ * Пропускная способность пакетного вычисления на разных наборах инструкций
+ * в сравнении с построчным вычислением байткода
+ * */
+template<typename Function>
+static double measure(Function function, size_t repeats) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; i++)
+        function();
+    auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(finish - start).count();
+}
+
+int main(int argc, char *argv[]) {
+    size_t rows = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    size_t repeats = argc > 2 ? std::stoul(argv[2]) : 20;
+    std::string input = argc > 3 ? argv[3] : "price * (1 + rate) - fee / (qty + 1) * -discount + 0.5";
+
+    engine::Tokenizer tokenizer;
+    engine::Parser parser(&tokenizer);
+    tokenizer.set_input(input);
+    auto expression = parser.parse_expression();
+    engine::Program program(expression);
+
+    std::vector<std::vector<double>> columns(expression.variable_count, std::vector<double>(rows));
+    std::vector<const double *> column_pointers;
+    for (size_t slot = 0; slot < columns.size(); slot++) {
+        for (size_t row = 0; row < rows; row++)
+            columns[slot][row] = 1.0 + double((row * 7 + slot * 13) % 101) / 10.0;
+        column_pointers.push_back(columns[slot].data());
+    }
+    std::vector<double> out(rows);
+    std::vector<double> row_values(columns.size());
+
+    std::printf("expression: %s\nrows: %zu, repeats: %zu\n", input.c_str(), rows, repeats);
+
+    volatile double sink = 0;
+    double per_row = measure([&] {
+        for (size_t row = 0; row < rows; row++) {
+            for (size_t slot = 0; slot < columns.size(); slot++)
+                row_values[slot] = columns[slot][row];
+            sink = sink + program.eval(row_values.data());
+        }
+    }, repeats);
+    std::printf("%-16s %8.3f ns/row\n", "program per row", per_row / double(rows * repeats));
+
+    auto best = engine::simd::detect();
+    for (auto isa : {engine::simd::scalar, engine::simd::sse2, engine::simd::avx2, engine::simd::avx512}) {
+        if (isa > best)
+            break;
+        engine::simd::use(isa);
+        expression.eval_batch(column_pointers.data(), rows, out.data());
+        double batch = measure([&] {
+            expression.eval_batch(column_pointers.data(), rows, out.data());
+            sink = sink + out[rows / 2];
+        }, repeats);
+        std::printf("%-16s %8.3f ns/row\n", engine::simd::isa_name(isa), batch / double(rows * repeats));
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <chrono>
+#include <cstdio>
+#include <string_view>
+
+#include "engine.h"
+#include "jit.h"
+#include "program.h"
+#include "static_expression.h"
+
+using namespace engine::literals;
+
+/*
+ * Формула, известная при компиляции: "..."_expr против разбора того же текста
+ * в рантайме (дерево, байткод, JIT). Заодно проверяет, что результаты совпадают
+ * */
+template<typename Function>
+static double measure(Function function, size_t repeats) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; i++)
+        function();
+    auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(finish - start).count();
+}
+
+static bool same(double left, double right) {
+    return left == right || (left != left && right != right);
+}
+
+int main(int argc, char *argv[]) {
+    size_t repeats = argc > 1 ? std::stoul(argv[1]) : 10000000;
+
+    constexpr auto formula = "spot * max(1 - strike / spot, 0) * exp(-rate * time) + (spot - strike)^2 / 2 // 1"_expr;
+    constexpr std::string_view text =
+            "spot * max(1 - strike / spot, 0) * exp(-rate * time) + (spot - strike)^2 / 2 // 1";
+
+    engine::Tokenizer tokenizer;
+    engine::Parser parser(&tokenizer);
+    tokenizer.set_input(text);
+    auto expression = parser.parse_expression();
+    engine::Program program(expression);
+    engine::JitFunction jit(expression);
+
+    // переменные в том же порядке слотов
+    double values[] = {105.5, 100, 0.03, 0.5};
+    bool match = true;
+    for (size_t i = 0; i < 1000; i++) {
+        values[0] = 80 + 0.05 * double(i);
+        double expected = formula.eval(values);
+        match = match && same(expected, expression.eval(values)) && same(expected, program.eval(values))
+                && same(expected, jit.eval(values));
+    }
+    std::printf("expression: %s\nvariables: %zu, runtime parser %s\n", text.data(), formula.variable_count,
+                match ? "matches" : "DOES NOT MATCH");
+
+    volatile double sink = 0;
+    double compiled = measure([&] {
+        values[0] += 1e-9;
+        sink = sink + formula.eval(values);
+    }, repeats);
+    double tree = measure([&] {
+        values[0] += 1e-9;
+        sink = sink + expression.eval(values);
+    }, repeats);
+    double bytecode = measure([&] {
+        values[0] += 1e-9;
+        sink = sink + program.eval(values);
+    }, repeats);
+    double native = measure([&] {
+        values[0] += 1e-9;
+        sink = sink + jit.eval(values);
+    }, repeats);
+
+    std::printf("%-20s %8.3f ns/eval\n", "_expr", compiled / double(repeats));
+    std::printf("%-20s %8.3f ns/eval\n", "tree", tree / double(repeats));
+    std::printf("%-20s %8.3f ns/eval\n", "program", bytecode / double(repeats));
+    std::printf("%-20s %8.3f ns/eval\n", jit.is_native() ? "jit native code" : "jit (interpreted)",
+                native / double(repeats));
+    return match ? 0 : 1;
+}
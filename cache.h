@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cctype>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "engine.h"
+#include "optimize.h"
+#include "program.h"
+
+
+namespace engine {
+    // Готовое к вычислению выражение: программа и имена ее переменных по слотам
+    struct CompiledExpression {
+        Program program;
+        std::vector<std::string> variables;
+    };
+
+    /*
+     * Ограниченный LRU-кеш скомпилированных выражений.
+     * Ключ - текст без лишних пробелов, поэтому "1 + x" и "1+x" разбираются один раз.
+     * Можно вызывать из нескольких потоков
+     * */
+    class ExpressionCache {
+    public:
+        struct Statistics {
+            size_t hits = 0;
+            size_t misses = 0;
+            size_t evictions = 0;
+        };
+
+        explicit ExpressionCache(size_t capacity) {
+            this->capacity = capacity == 0 ? 1 : capacity;
+        }
+
+        /*
+         * Убирает пробелы, которые ничего не разделяют.
+         * Пробел между двумя числами или именами (или между < и =, / и /) остается,
+         * чтобы "1 2" не превратилось в корректное "12"
+         * */
+        static std::string normalize(std::string_view text) {
+            std::string result;
+            result.reserve(text.size());
+
+            bool pending_space = false;
+            for (char symbol : text) {
+                if (symbol == ' ') {
+                    pending_space = !result.empty();
+                    continue;
+                }
+                if (pending_space && joins(result.back(), symbol))
+                    result += ' ';
+                pending_space = false;
+                result += symbol;
+            }
+            return result;
+        }
+
+        // Возвращает скомпилированное выражение, разбирая текст только при промахе
+        std::shared_ptr<const CompiledExpression> get(std::string_view text) {
+            std::string key = normalize(text);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto found = index.find(key);
+                if (found != index.end()) {
+                    counters.hits++;
+                    entries.splice(entries.begin(), entries, found->second);
+                    return found->second->compiled;
+                }
+                counters.misses++;
+            }
+
+            // компилируем без блокировки, чтобы не задерживать другие потоки
+            auto compiled = compile(key);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = index.find(key);
+            if (found != index.end()) {
+                entries.splice(entries.begin(), entries, found->second);
+                return found->second->compiled;
+            }
+
+            entries.push_front({key, compiled});
+            index.emplace(std::move(key), entries.begin());
+
+            if (entries.size() > capacity) {
+                index.erase(entries.back().key);
+                entries.pop_back();
+                counters.evictions++;
+            }
+            return compiled;
+        }
+
+        Statistics statistics() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return counters;
+        }
+
+        size_t size() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return entries.size();
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> lock(mutex);
+            entries.clear();
+            index.clear();
+        }
+
+    private:
+        struct Entry {
+            std::string key;
+            std::shared_ptr<const CompiledExpression> compiled;
+        };
+
+        size_t capacity;
+        mutable std::mutex mutex;
+        // в начале списка - недавно использованные
+        std::list<Entry> entries;
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+        Statistics counters;
+
+        static bool is_word_char(char symbol) {
+            return isalnum((unsigned char) symbol) || symbol == '_' || symbol == '.';
+        }
+
+        // Склеятся ли два символа в один токен, если убрать пробел между ними
+        static bool joins(char left, char right) {
+            if (is_word_char(left) && is_word_char(right))
+                return true;
+            if (left == '/' && right == '/')
+                return true;
+            return right == '=' && (left == '<' || left == '>' || left == '=' || left == '!');
+        }
+
+        static std::shared_ptr<const CompiledExpression> compile(const std::string &text) {
+            Tokenizer tokenizer;
+            Parser parser(&tokenizer);
+            tokenizer.set_input(text);
+
+            auto expression = parser.parse_expression();
+            optimize(expression);
+            share_subexpressions(expression);
+
+            auto compiled = std::make_shared<CompiledExpression>();
+            compiled->program = Program(expression);
+            compiled->variables = parser.variables;
+            return compiled;
+        }
+    };
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+
+namespace engine {
+    namespace detail {
+        // Неотрицательное целое произвольной длины, разряды по 32 бита, младшие первыми
+        class BigInteger {
+        public:
+            constexpr explicit BigInteger(uint64_t value = 0) {
+                while (value != 0) {
+                    limbs.push_back((uint32_t) value);
+                    value >>= 32;
+                }
+            }
+
+            // *this = *this * factor + addend
+            constexpr void multiply_add(uint32_t factor, uint32_t addend) {
+                uint64_t carry = addend;
+                for (auto &limb : limbs) {
+                    uint64_t product = (uint64_t) limb * factor + carry;
+                    limb = (uint32_t) product;
+                    carry = product >> 32;
+                }
+                if (carry != 0)
+                    limbs.push_back((uint32_t) carry);
+            }
+
+            constexpr void shift_left(size_t bits) {
+                if (limbs.empty())
+                    return;
+                size_t rest = bits % 32;
+                if (rest != 0) {
+                    uint32_t carry = 0;
+                    for (auto &limb : limbs) {
+                        uint32_t next = limb >> (32 - rest);
+                        limb = (limb << rest) | carry;
+                        carry = next;
+                    }
+                    if (carry != 0)
+                        limbs.push_back(carry);
+                }
+                limbs.insert(limbs.begin(), bits / 32, 0);
+            }
+
+            // other <= *this
+            constexpr void subtract(const BigInteger &other) {
+                uint64_t borrow = 0;
+                for (size_t i = 0; i < limbs.size(); i++) {
+                    uint64_t subtrahend = (i < other.limbs.size() ? other.limbs[i] : 0) + borrow;
+                    borrow = limbs[i] < subtrahend;
+                    limbs[i] = (uint32_t) (limbs[i] - subtrahend);
+                }
+                while (!limbs.empty() && limbs.back() == 0)
+                    limbs.pop_back();
+            }
+
+            constexpr size_t bit_length() const {
+                return limbs.empty() ? 0 : 32 * (limbs.size() - 1) + std::bit_width(limbs.back());
+            }
+
+            constexpr bool is_zero() const {
+                return limbs.empty();
+            }
+
+            // Значение, если оно помещается в 64 бита
+            constexpr uint64_t low_bits() const {
+                uint64_t value = 0;
+                for (size_t i = limbs.size(); i-- > 0;)
+                    value = (value << 32) | limbs[i];
+                return value;
+            }
+
+            friend constexpr bool operator<(const BigInteger &left, const BigInteger &right) {
+                if (left.limbs.size() != right.limbs.size())
+                    return left.limbs.size() < right.limbs.size();
+                for (size_t i = left.limbs.size(); i-- > 0;) {
+                    if (left.limbs[i] != right.limbs[i])
+                        return left.limbs[i] < right.limbs[i];
+                }
+                return false;
+            }
+
+        private:
+            // без ведущих нулей, у нуля пустой
+            std::vector<uint32_t> limbs;
+        };
+
+        /*
+         * value * 2^exponent шагами, в которых множитель - нормальное число.
+         * value - целое до 2^54, поэтому произведение точное или больше DBL_MAX:
+         * тогда бесконечность, само переполнение при компиляции не константа
+         * */
+        constexpr double scale_by_power_of_two(double value, int exponent) {
+            while (exponent > 0) {
+                int step = exponent > 1000 ? 1000 : exponent;
+                if (value >= std::bit_cast<double>(uint64_t(1024 - step + 1023) << 52))
+                    return std::numeric_limits<double>::infinity();
+                value *= std::bit_cast<double>(uint64_t(step + 1023) << 52);
+                exponent -= step;
+            }
+            while (exponent < -1000) {
+                value *= std::bit_cast<double>(uint64_t(-1000 + 1023) << 52);
+                exponent += 1000;
+            }
+            return value * std::bit_cast<double>(uint64_t(exponent + 1023) << 52);
+        }
+    }
+
+    /*
+     * Десятичное число вида 12, 12.5, .5 или 12. в ближайший double, как std::from_chars.
+     * В отличие от него работает при компиляции: короткие числа - одним точным делением,
+     * длинные - делением длинных целых
+     * */
+    constexpr double decimal_to_double(std::string_view text) {
+        detail::BigInteger numerator;
+        uint64_t digits = 0;
+        size_t digit_count = 0;
+        size_t fraction_digits = 0;
+        bool has_point = false;
+
+        for (char symbol : text) {
+            if (symbol == '.' && !has_point) {
+                has_point = true;
+                continue;
+            }
+            if (symbol < '0' || symbol > '9')
+                throw std::logic_error("Invalid number");
+
+            numerator.multiply_add(10, (uint32_t) (symbol - '0'));
+            digits = digits * 10 + (uint64_t) (symbol - '0');
+            digit_count++;
+            fraction_digits += has_point;
+        }
+        if (digit_count == 0)
+            throw std::logic_error("Invalid number");
+        if (numerator.is_zero())
+            return 0;
+
+        // целое до 2^53 и степень десяти до 10^22 точны, частное округляется один раз
+        if (numerator.bit_length() <= 53 && fraction_digits <= 22) {
+            double power = 1;
+            for (size_t i = 0; i < fraction_digits; i++)
+                power *= 10;
+            return (double) digits / power;
+        }
+
+        detail::BigInteger denominator(1);
+        for (size_t i = 0; i < fraction_digits; i++)
+            denominator.multiply_add(10, 0);
+
+        /*
+         * Ищем r = round(numerator * 2^t / denominator) из 53 бит, результат - r * 2^-t.
+         * quotient считается с одним лишним битом для округления, остаток решает ничьи.
+         * t не больше 1074: дальше идут денормализованные числа с меньшим числом бит
+         * */
+        int t = 53 - ((int) numerator.bit_length() - (int) denominator.bit_length());
+        while (true) {
+            if (t > 1074)
+                t = 1074;
+
+            detail::BigInteger remainder = numerator;
+            detail::BigInteger divisor = denominator;
+            if (t + 1 >= 0)
+                remainder.shift_left((size_t) (t + 1));
+            else
+                divisor.shift_left((size_t) -(t + 1));
+
+            // частное меньше 2^55, делим столбиком по битам
+            uint64_t quotient = 0;
+            for (int bit = 55; bit >= 0; bit--) {
+                detail::BigInteger shifted = divisor;
+                shifted.shift_left((size_t) bit);
+                if (!(remainder < shifted)) {
+                    remainder.subtract(shifted);
+                    quotient |= uint64_t(1) << bit;
+                }
+            }
+
+            if (quotient >= uint64_t(1) << 54) {
+                t--;
+                continue;
+            }
+
+            uint64_t rounded = quotient >> 1;
+            if ((quotient & 1) != 0 && (!remainder.is_zero() || (rounded & 1) != 0))
+                rounded++;
+            return detail::scale_by_power_of_two((double) rounded, -t);
+        }
+    }
+}
@@ -0,0 +1,1683 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <charconv>
+#include <cmath>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "decimal.h"
+#include "functions.h"
+#include "simd.h"
+
+
+namespace engine {
+    // Типы символов, которые может обработать калькулятор
+    enum Token {
+        addition,
+        subtraction,
+        multiplication,
+        division,
+        opened_parentheses,
+        closed_parentheses,
+        number,
+        identifier,
+        less,
+        less_equal,
+        greater,
+        greater_equal,
+        equal,
+        not_equal,
+        power,
+        modulo,
+        integer_division,
+        // разделитель аргументов функции
+        comma,
+        // скобки, уже разобранные целиком: так IncrementalParser отдает вложенные группы, Tokenizer его не дает
+        parsed_group,
+        eof,
+    };
+
+    constexpr size_t token_count = engine::eof + 1;
+
+    // Как бинарный оператор связывает операнды
+    struct OperatorInfo {
+        // 0 - токен не бинарный оператор, чем больше, тем сильнее связывает
+        int precedence = 0;
+        bool right_associative = false;
+    };
+
+    /*
+     * Таблица бинарных операторов для парсера.
+     * Новый оператор - это токен, строка здесь и ветка в apply_binary,
+     * новых функций разбора не нужно
+     * */
+    constexpr std::array<OperatorInfo, token_count> make_operator_table() {
+        std::array<OperatorInfo, token_count> table{};
+        table[engine::equal] = {1, false};
+        table[engine::not_equal] = {1, false};
+        table[engine::less] = {2, false};
+        table[engine::less_equal] = {2, false};
+        table[engine::greater] = {2, false};
+        table[engine::greater_equal] = {2, false};
+        table[engine::addition] = {3, false};
+        table[engine::subtraction] = {3, false};
+        table[engine::multiplication] = {4, false};
+        table[engine::division] = {4, false};
+        table[engine::modulo] = {4, false};
+        table[engine::integer_division] = {4, false};
+        // 2^3^2 = 2^(3^2), -x^2 = -(x^2)
+        table[engine::power] = {6, true};
+        return table;
+    }
+
+    inline constexpr std::array<OperatorInfo, token_count> operator_table = make_operator_table();
+
+    // Унарный минус связывает сильнее сложения и умножения, но слабее степени
+    constexpr int unary_precedence = 5;
+
+    /*
+     * Класс бьет строку по токенам.
+     * Строка не копируется: она должна жить, пока идет разбор.
+     * Работает и в constexpr: там числа переводит decimal_to_double вместо std::from_chars
+     * */
+    class Tokenizer {
+    private:
+        // выражение, которое считает калькулятор
+        std::string_view input;
+    public:
+        Token current_token = engine::number;
+        char current_char = 1;
+        double number = 0;
+        // имя переменной для engine::identifier, указывает внутрь input
+        std::string_view name;
+
+        int position = 0;
+
+        constexpr void next_char() {
+            char symbol = (size_t) this->position < this->input.size() ? this->input[this->position] : '\0';
+            this->position++;
+
+            this->current_char = symbol < 0 ? '\0' : symbol;
+        }
+
+        /*
+         * Input setter
+         * Use for request your computational problem
+         * */
+        constexpr void set_input(std::string_view _input) {
+            position = 0;
+            current_char = 1;
+            current_token = engine::number;
+            this->input = _input;
+
+            next_char();
+            next_token();
+        }
+
+        // Съедает символ, если это expected (вторая половина токенов вроде <=)
+        constexpr bool match(char expected) {
+            if (this->current_char != expected)
+                return false;
+            next_char();
+            return true;
+        }
+
+        constexpr void next_token() {
+            // пропускаем пробелы
+            while (this->current_char == ' ') {
+                this->next_char();
+            }
+
+            /*
+             * Если не пробел, то оперделяем
+             * какой из доступных символов
+             *
+             * */
+            switch (this->current_char) {
+                case '\0':
+                    this->current_token = engine::eof;
+                    return;
+                case '+':
+                    this->next_char();
+                    this->current_token = engine::addition;
+                    return;
+                case '-':
+                    this->next_char();
+                    this->current_token = engine::subtraction;
+                    return;
+                case '*':
+                    this->next_char();
+                    this->current_token = engine::multiplication;
+                    return;
+                case '/':
+                    this->next_char();
+                    this->current_token = match('/') ? engine::integer_division : engine::division;
+                    return;
+                case '^':
+                    this->next_char();
+                    this->current_token = engine::power;
+                    return;
+                case '%':
+                    this->next_char();
+                    this->current_token = engine::modulo;
+                    return;
+                case ',':
+                    this->next_char();
+                    this->current_token = engine::comma;
+                    return;
+                case '<':
+                    this->next_char();
+                    this->current_token = match('=') ? engine::less_equal : engine::less;
+                    return;
+                case '>':
+                    this->next_char();
+                    this->current_token = match('=') ? engine::greater_equal : engine::greater;
+                    return;
+                case '=':
+                    this->next_char();
+                    if (!match('='))
+                        throw std::logic_error("Not supported type of operator: |=|");
+                    this->current_token = engine::equal;
+                    return;
+                case '!':
+                    this->next_char();
+                    if (!match('='))
+                        throw std::logic_error("Not supported type of operator: |!|");
+                    this->current_token = engine::not_equal;
+                    return;
+                case '(':
+                    this->next_char();
+                    this->current_token = engine::opened_parentheses;
+                    return;
+                case ')':
+                    this->next_char();
+                    this->current_token = engine::closed_parentheses;
+                    return;
+            }
+
+            // обрабатываем число
+            if (is_digit(this->current_char) || this->current_char == '.') {
+                bool is_decimal = false;
+                size_t start = this->position - 1;
+
+                while (is_digit(this->current_char) || (!is_decimal && this->current_char == '.')) {
+                    is_decimal = is_decimal || this->current_char == '.';
+                    next_char();
+                }
+
+                // конвертируем число прямо во входной строке
+                if (std::is_constant_evaluated()) {
+                    this->number = decimal_to_double(this->input.substr(start, this->position - 1 - start));
+                } else {
+                    const char *first = this->input.data() + start;
+                    const char *last = this->input.data() + this->position - 1;
+                    auto result = std::from_chars(first, last, this->number);
+                    // вне диапазона double - inf или 0, как у decimal_to_double
+                    if (result.ec == std::errc::result_out_of_range && result.ptr == last)
+                        this->number = decimal_to_double(this->input.substr(start, this->position - 1 - start));
+                    else if (result.ec != std::errc() || result.ptr != last)
+                        throw std::logic_error("Invalid number");
+                }
+
+                this->current_token = engine::number;
+                return;
+            }
+
+            // обрабатываем имя переменной: буквы, цифры и подчеркивания
+            if (is_letter(this->current_char) || this->current_char == '_') {
+                size_t start = this->position - 1;
+
+                while (is_letter(this->current_char) || is_digit(this->current_char) || this->current_char == '_')
+                    next_char();
+
+                this->name = this->input.substr(start, this->position - 1 - start);
+                this->current_token = engine::identifier;
+                return;
+            }
+
+            // Получили символ, который не поддерживается калькулятором
+            throw std::logic_error(std::string("Not supported type of operator: |") + current_char + "|");
+        }
+
+        // isdigit и isalpha для "C" локали, но constexpr
+        static constexpr bool is_digit(char symbol) {
+            return symbol >= '0' && symbol <= '9';
+        }
+
+        static constexpr bool is_letter(char symbol) {
+            return (symbol >= 'a' && symbol <= 'z') || (symbol >= 'A' && symbol <= 'Z');
+        }
+
+        /*
+         * Use input setter instead
+         *
+            explicit Tokenizer(std::string input) {
+                this->input = std::move(input);
+
+                next_char();
+                next_token();
+            }
+        */
+        Tokenizer() = default;
+    };
+
+    // Арена: выделяет память под ноды блоками и освобождает её разом
+    class Arena {
+    private:
+        struct Block {
+            Block *next;
+            size_t size;
+        };
+
+        // Деструкторы объектов, которые нельзя просто забыть
+        struct Destructor {
+            void (*destroy)(void *);
+            void *object;
+            Destructor *next;
+        };
+
+        Block *head = nullptr;
+        char *current = nullptr;
+        char *end = nullptr;
+        Destructor *destructors = nullptr;
+        size_t block_size;
+
+        void add_block(size_t min_size) {
+            size_t size = block_size;
+            while (size < min_size + sizeof(Block))
+                size *= 2;
+
+            auto *block = static_cast<Block *>(std::malloc(size));
+            if (block == nullptr)
+                throw std::bad_alloc();
+
+            block->next = head;
+            block->size = size;
+            head = block;
+            allocations++;
+
+            current = reinterpret_cast<char *>(block) + sizeof(Block);
+            end = reinterpret_cast<char *>(block) + size;
+
+            // следующий блок будет больше, чтобы разбор шел за пару аллокаций
+            if (block_size < max_block_size)
+                block_size *= 2;
+        }
+
+        void run_destructors() {
+            for (auto *destructor = destructors; destructor != nullptr; destructor = destructor->next)
+                destructor->destroy(destructor->object);
+            destructors = nullptr;
+        }
+
+    public:
+        static constexpr size_t default_block_size = 4096;
+        static constexpr size_t max_block_size = 1 << 20;
+
+        // сколько раз арена обращалась к malloc за все время
+        size_t allocations = 0;
+
+        explicit Arena(size_t block_size = default_block_size) {
+            this->block_size = block_size;
+        }
+
+        Arena(const Arena &) = delete;
+        Arena &operator=(const Arena &) = delete;
+
+        Arena(Arena &&other) noexcept {
+            *this = std::move(other);
+        }
+
+        Arena &operator=(Arena &&other) noexcept {
+            if (this != &other) {
+                release();
+                head = std::exchange(other.head, nullptr);
+                current = std::exchange(other.current, nullptr);
+                end = std::exchange(other.end, nullptr);
+                destructors = std::exchange(other.destructors, nullptr);
+                block_size = other.block_size;
+                allocations = other.allocations;
+            }
+            return *this;
+        }
+
+        ~Arena() {
+            release();
+        }
+
+        void *allocate(size_t size, size_t alignment) {
+            auto address = reinterpret_cast<uintptr_t>(current);
+            auto aligned = (address + alignment - 1) & ~(uintptr_t) (alignment - 1);
+
+            if (current == nullptr || aligned + size > reinterpret_cast<uintptr_t>(end)) {
+                add_block(size + alignment);
+                address = reinterpret_cast<uintptr_t>(current);
+                aligned = (address + alignment - 1) & ~(uintptr_t) (alignment - 1);
+            }
+
+            current = reinterpret_cast<char *>(aligned + size);
+            return reinterpret_cast<void *>(aligned);
+        }
+
+        // Создает объект в арене, деструктор вызовется при reset() или release()
+        template<typename T, typename... Args>
+        T *make(Args &&... args) {
+            void *memory = allocate(sizeof(T), alignof(T));
+            T *object = new(memory) T(std::forward<Args>(args)...);
+
+            if constexpr (!std::is_trivially_destructible_v<T>) {
+                auto *destructor = new(allocate(sizeof(Destructor), alignof(Destructor))) Destructor;
+                destructor->destroy = [](void *pointer) { static_cast<T *>(pointer)->~T(); };
+                destructor->object = object;
+                destructor->next = destructors;
+                destructors = destructor;
+            }
+            return object;
+        }
+
+        // Массив из count объектов, которым не нужен деструктор
+        template<typename T>
+        T *make_array(size_t count) {
+            static_assert(std::is_trivially_destructible_v<T>, "Array elements are never destroyed");
+            auto *array = static_cast<T *>(allocate(sizeof(T) * count, alignof(T)));
+            for (size_t i = 0; i < count; i++)
+                new(array + i) T();
+            return array;
+        }
+
+        /*
+         * Уничтожает все объекты, но оставляет последний (самый большой) блок,
+         * чтобы следующий разбор обошелся без malloc
+         * */
+        void reset() {
+            run_destructors();
+            if (head == nullptr)
+                return;
+
+            while (head->next != nullptr) {
+                Block *next = head->next;
+                head->next = next->next;
+                std::free(next);
+            }
+            current = reinterpret_cast<char *>(head) + sizeof(Block);
+            end = reinterpret_cast<char *>(head) + head->size;
+        }
+
+        // Уничтожает все объекты и отдает память системе
+        void release() {
+            run_destructors();
+            while (head != nullptr) {
+                Block *next = head->next;
+                std::free(head);
+                head = next;
+            }
+            current = nullptr;
+            end = nullptr;
+        }
+
+        size_t bytes_reserved() const {
+            size_t total = 0;
+            for (auto *block = head; block != nullptr; block = block->next)
+                total += block->size;
+            return total;
+        }
+    };
+
+    // Виды нод, чтобы проходы по дереву могли различать их без dynamic_cast
+    enum NodeType {
+        number_node,
+        variable_node,
+        binary_operation_node,
+        unary_operation_node,
+        call_node,
+    };
+
+    // Сколько строк за раз обрабатывает пакетное вычисление
+    constexpr size_t batch_block_size = 256;
+
+    class Node {
+        public:
+        NodeType type;
+
+        explicit Node(NodeType type) {
+            this->type = type;
+        }
+
+        // variables - значения переменных по их слотам. Рекурсивно, для неглубоких деревьев
+        virtual double eval(const double *variables) = 0;
+    };
+
+    // Нода для числа
+    class NumberNode : public Node {
+    public:
+        double number;
+
+        explicit NumberNode(double number) : Node(engine::number_node) {
+            this->number = number;
+        }
+
+        double eval(const double *) override {
+            return number;
+        }
+    };
+
+    // Нода для переменной, имя уже разрешено в номер слота
+    class VariableNode : public Node {
+    public:
+        size_t slot;
+
+        explicit VariableNode(size_t slot) : Node(engine::variable_node) {
+            this->slot = slot;
+        }
+
+        double eval(const double *variables) override {
+            return variables[slot];
+        }
+    };
+
+    /*
+     * Степени с постоянным показателем, которые считаются без pow:
+     * x^2 и x^3 - умножениями, x^0.5 - через sqrt, остальные целые от 0 до 16 - через powi.
+     * Так считаются все пути (дерево, Program, JIT, пакеты), поэтому результаты совпадают между собой.
+     * С std::pow совпадают x^2 и x^0.5, кроме -inf^0.5: он дает NaN вместо +inf.
+     * x^3 и powi округляют каждое умножение и расходятся с pow в последнем бите
+     * (для показателей 4..16 - у большинства оснований), а у субнормальных результатов и сильнее.
+     * Отрицательные показатели считает pow: 1 / powi переполняется раньше самой степени
+     * */
+    enum PowerReduction {
+        no_reduction,
+        square_power,
+        cube_power,
+        sqrt_power,
+        integer_power,
+    };
+
+    constexpr int max_reduced_exponent = 16;
+
+    /*
+     * std::trunc, std::floor и std::fmod, которые можно звать при компиляции.
+     * Все три точные, поэтому результат совпадает с libm до бита, включая -0 и NaN
+     * */
+    constexpr double constant_trunc(double x) {
+        // большие числа уже целые, бесконечности и NaN остаются собой
+        if (!(x > -0x1p52 && x < 0x1p52))
+            return x;
+        double truncated = (double) (int64_t) x;
+        // x * 0 сохраняет знак нуля: trunc(-0.5) = -0
+        return truncated == 0 ? x * 0 : truncated;
+    }
+
+    constexpr double constant_floor(double x) {
+        double truncated = constant_trunc(x);
+        return truncated > x ? truncated - 1 : truncated;
+    }
+
+    constexpr double constant_fmod(double x, double y) {
+        if (x != x || y != y || y == 0 || x == std::numeric_limits<double>::infinity()
+            || x == -std::numeric_limits<double>::infinity())
+            return std::numeric_limits<double>::quiet_NaN();
+
+        constexpr uint64_t sign = uint64_t(1) << 63;
+        double rest = std::bit_cast<double>(std::bit_cast<uint64_t>(x) & ~sign);
+        double divisor = std::bit_cast<double>(std::bit_cast<uint64_t>(y) & ~sign);
+        if (divisor == std::numeric_limits<double>::infinity())
+            return x;
+
+        // вычитаем divisor * 2^k от больших k к меньшим, каждое вычитание точное
+        double step = divisor;
+        while (step * 2 <= rest)
+            step *= 2;
+        for (; step >= divisor; step /= 2) {
+            if (rest >= step)
+                rest -= step;
+        }
+        return std::bit_cast<double>(std::bit_cast<uint64_t>(rest) | (std::bit_cast<uint64_t>(x) & sign));
+    }
+
+    constexpr PowerReduction reduce_power(double exponent) {
+        if (exponent == 2)
+            return square_power;
+        if (exponent == 3)
+            return cube_power;
+        if (exponent == 0.5)
+            return sqrt_power;
+        if (exponent == constant_trunc(exponent) && exponent >= 0 && exponent <= max_reduced_exponent)
+            return integer_power;
+        return no_reduction;
+    }
+
+    // Возведение в неотрицательную целую степень двоичным разложением показателя
+    constexpr double powi(double base, unsigned exponent) {
+        double result = 1;
+        while (exponent != 0) {
+            if (exponent & 1)
+                result *= base;
+            exponent >>= 1;
+            if (exponent != 0)
+                base *= base;
+        }
+        return result;
+    }
+
+    // x^0.5 через sqrt. sqrt(-0) = -0, а pow(-0, 0.5) = +0: прибавление +0 дает +0
+    inline double half_power(double base) {
+        return std::sqrt(base) + 0.0;
+    }
+
+    /*
+     * x^y для всех путей вычисления: постоянный показатель дает тот же результат, что и сокращенный.
+     * При компиляции считаются только умножения: std::sqrt и std::pow в C++20 не constexpr,
+     * и то, что GCC их все равно сворачивает, - расширение компилятора
+     * */
+    constexpr double exponentiate(double base, double exponent) {
+        switch (reduce_power(exponent)) {
+            case engine::square_power:
+                return base * base;
+            case engine::cube_power:
+                return base * base * base;
+            case engine::integer_power:
+                return powi(base, (unsigned) exponent);
+            default:
+                break;
+        }
+        if (std::is_constant_evaluated())
+            throw std::logic_error("Power is not a constant expression");
+        if (reduce_power(exponent) == engine::sqrt_power)
+            return half_power(base);
+        return std::pow(base, exponent);
+    }
+
+    // Выполняет бинарную операцию по ее токену
+    constexpr double apply_binary(Token operation, double left, double right) {
+        switch (operation) {
+            case engine::addition:
+                return left + right;
+            case engine::subtraction:
+                return left - right;
+            case engine::multiplication:
+                return left * right;
+            case engine::division:
+                return left / right;
+            // сравнения дают 1 или 0
+            case engine::less:
+                return left < right;
+            case engine::less_equal:
+                return left <= right;
+            case engine::greater:
+                return left > right;
+            case engine::greater_equal:
+                return left >= right;
+            case engine::equal:
+                return left == right;
+            case engine::not_equal:
+                return left != right;
+            case engine::power:
+                return exponentiate(left, right);
+            // остаток со знаком делимого, как fmod
+            case engine::modulo:
+                return std::is_constant_evaluated() ? constant_fmod(left, right) : std::fmod(left, right);
+            case engine::integer_division:
+                return std::is_constant_evaluated() ? constant_floor(left / right) : std::floor(left / right);
+            default:
+                throw std::logic_error("Not a binary operator");
+        }
+    }
+
+    // Выполняет унарную операцию по ее токену
+    constexpr double apply_unary(Token operation, double value) {
+        switch (operation) {
+            case engine::addition:
+                return value;
+            case engine::subtraction:
+                return -value;
+            default:
+                throw std::logic_error("Not an unary operator");
+        }
+    }
+
+    // Нода для бинарных операций
+    class BinaryOperationNode : public Node {
+    public:
+        Node *left_leaf;
+        Node *right_leaf;
+        Token operation;
+
+        BinaryOperationNode(Node *left_leaf, Node *right_leaf, Token operation) : Node(engine::binary_operation_node) {
+            this->left_leaf = left_leaf;
+            this->right_leaf = right_leaf;
+            this->operation = operation;
+        }
+
+        double eval(const double *variables) override {
+            auto left_leaf_value = left_leaf->eval(variables);
+            auto right_leaf_value = right_leaf->eval(variables);
+
+            return apply_binary(operation, left_leaf_value, right_leaf_value);
+        }
+    };
+
+    // Нода для унарных операций
+    class UnaryOperationNode : public Node {
+    public:
+        Node *right_leaf;
+        Token operation;
+
+        UnaryOperationNode(Node *right_leaf, Token operation) : Node(engine::unary_operation_node) {
+            this->right_leaf = right_leaf;
+            this->operation = operation;
+        }
+
+        double eval(const double *variables) override {
+            auto right_leaf_value = right_leaf->eval(variables);
+
+            return apply_unary(operation, right_leaf_value);
+        }
+    };
+
+    // Нода вызова функции, функция найдена при разборе
+    class CallNode : public Node {
+    public:
+        const Function *function;
+        // массив в арене выражения, по одной ноде на аргумент
+        Node **arguments;
+        size_t argument_count;
+
+        CallNode(const Function *function, Node **arguments) : Node(engine::call_node) {
+            this->function = function;
+            this->arguments = arguments;
+            this->argument_count = function->arity;
+        }
+
+        double eval(const double *variables) override {
+            double values[max_arguments];
+            for (size_t i = 0; i < argument_count; i++)
+                values[i] = arguments[i]->eval(variables);
+            return function->call(values);
+        }
+    };
+
+    // Первый операнд операции или вызова, nullptr - если нода считается сразу
+    inline const Node *first_operand(const Node *node) {
+        switch (node->type) {
+            case engine::binary_operation_node:
+                return static_cast<const BinaryOperationNode *>(node)->left_leaf;
+            case engine::unary_operation_node:
+                return static_cast<const UnaryOperationNode *>(node)->right_leaf;
+            case engine::call_node: {
+                auto call = static_cast<const CallNode *>(node);
+                return call->argument_count > 0 ? call->arguments[0] : nullptr;
+            }
+            default:
+                return nullptr;
+        }
+    }
+
+    // Сколько операндов у ноды
+    inline size_t operand_count(const Node *node) {
+        switch (node->type) {
+            case engine::binary_operation_node:
+                return 2;
+            case engine::unary_operation_node:
+                return 1;
+            case engine::call_node:
+                return static_cast<const CallNode *>(node)->argument_count;
+            default:
+                return 0;
+        }
+    }
+
+    // index-й операнд ноды по порядку вычисления
+    inline Node *operand(const Node *node, size_t index) {
+        switch (node->type) {
+            case engine::binary_operation_node: {
+                auto binary = static_cast<const BinaryOperationNode *>(node);
+                return index == 0 ? binary->left_leaf : binary->right_leaf;
+            }
+            case engine::unary_operation_node:
+                return static_cast<const UnaryOperationNode *>(node)->right_leaf;
+            default:
+                return static_cast<const CallNode *>(node)->arguments[index];
+        }
+    }
+
+    /*
+     * Вычисление дерева без рекурсии.
+     * Спускаемся по левым веткам, запоминая родителей на явном стеке,
+     * поэтому цепочка из миллионов операций не переполняет стек вызовов.
+     * Стеки переиспользуются между вызовами
+     * */
+    class Evaluator {
+    public:
+        double eval(const Node *root, const double *variables) {
+            frames.clear();
+            values.clear();
+
+            const Node *node = root;
+            while (true) {
+                // спуск до листа, родители запоминаются
+                while (const Node *operand = first_operand(node)) {
+                    frames.push_back({node, 0});
+                    node = operand;
+                }
+
+                double value = leaf_value(node, variables);
+
+                // подъем: применяем операции, пока не встретим непосчитанный операнд
+                while (true) {
+                    if (frames.empty())
+                        return value;
+
+                    auto &frame = frames.back();
+                    if (frame.node->type == engine::unary_operation_node) {
+                        value = apply_unary(static_cast<const UnaryOperationNode *>(frame.node)->operation, value);
+                        frames.pop_back();
+                        continue;
+                    }
+
+                    if (frame.node->type == engine::call_node) {
+                        auto call = static_cast<const CallNode *>(frame.node);
+                        values.push_back(value);
+                        if (++frame.done < call->argument_count) {
+                            node = call->arguments[frame.done];
+                            break;
+                        }
+
+                        // аргументы - последние argument_count значений стека
+                        size_t first = values.size() - call->argument_count;
+                        value = call->function->call(values.data() + first);
+                        values.resize(first);
+                        frames.pop_back();
+                        continue;
+                    }
+
+                    auto binary = static_cast<const BinaryOperationNode *>(frame.node);
+                    if (frame.done == 0) {
+                        // правый лист считаем сразу, не спускаясь в него
+                        if (is_leaf(binary->right_leaf)) {
+                            value = apply_binary(binary->operation, value, leaf_value(binary->right_leaf, variables));
+                            frames.pop_back();
+                            continue;
+                        }
+
+                        values.push_back(value);
+                        frame.done = 1;
+                        node = binary->right_leaf;
+                        break;
+                    }
+
+                    value = apply_binary(binary->operation, values.back(), value);
+                    values.pop_back();
+                    frames.pop_back();
+                }
+            }
+        }
+
+    private:
+        struct Frame {
+            const Node *node;
+            // сколько операндов уже посчитано
+            size_t done;
+        };
+
+        std::vector<Frame> frames;
+        // посчитанные левые операнды и аргументы, ждущие остальные
+        std::vector<double> values;
+
+        static bool is_leaf(const Node *node) {
+            return node->type == engine::number_node || node->type == engine::variable_node;
+        }
+
+        static double leaf_value(const Node *node, const double *variables) {
+            if (node->type == engine::number_node)
+                return static_cast<const NumberNode *>(node)->number;
+            if (node->type == engine::variable_node)
+                return variables[static_cast<const VariableNode *>(node)->slot];
+            // функция без аргументов
+            return static_cast<const CallNode *>(node)->function->call(nullptr);
+        }
+    };
+
+    /*
+     * Вычисление блока строк без рекурсии, обход как у Evaluator.
+     * Значение каждого поддерева - блок из count чисел на стеке blocks:
+     * операнды лежат подряд на вершине, операция пишет результат в блок первого из них.
+     * Одна операция на весь блок, векторное ядро выбрано по CPUID
+     * */
+    class BlockEvaluator {
+    public:
+        // Считает count <= batch_block_size строк начиная с offset, columns[slot] - столбец переменной
+        void eval(const Node *root, const double *const *columns, size_t offset, size_t count, double *out) {
+            frames.clear();
+            top = 0;
+
+            const Node *node = root;
+            while (true) {
+                while (const Node *operand = first_operand(node)) {
+                    frames.push_back({node, 0});
+                    node = operand;
+                }
+                push_leaf(node, columns, offset, count);
+
+                while (true) {
+                    if (frames.empty()) {
+                        std::copy(block(0), block(0) + count, out);
+                        return;
+                    }
+
+                    auto &frame = frames.back();
+                    if (frame.node->type == engine::unary_operation_node) {
+                        if (static_cast<const UnaryOperationNode *>(frame.node)->operation == engine::subtraction)
+                            simd::kernels().neg(block(top - 1), block(top - 1), count);
+                        frames.pop_back();
+                        continue;
+                    }
+
+                    if (frame.node->type == engine::call_node) {
+                        auto call = static_cast<const CallNode *>(frame.node);
+                        if (++frame.done < call->argument_count) {
+                            node = call->arguments[frame.done];
+                            break;
+                        }
+                        apply_call(call, count);
+                        frames.pop_back();
+                        continue;
+                    }
+
+                    auto binary = static_cast<const BinaryOperationNode *>(frame.node);
+                    if (frame.done == 0) {
+                        if (binary->operation == engine::power && power_block(binary, block(top - 1), count)) {
+                            frames.pop_back();
+                            continue;
+                        }
+                        frame.done = 1;
+                        node = binary->right_leaf;
+                        break;
+                    }
+
+                    apply_binary_block(binary->operation, block(top - 2), block(top - 1), count);
+                    top--;
+                    frames.pop_back();
+                }
+            }
+        }
+
+    private:
+        struct Frame {
+            const Node *node;
+            size_t done;
+        };
+
+        std::vector<Frame> frames;
+        // top блоков по batch_block_size, вершина - последний
+        std::vector<double> blocks;
+        size_t top = 0;
+
+        double *block(size_t index) {
+            return blocks.data() + index * batch_block_size;
+        }
+
+        double *push_block() {
+            if (blocks.size() < (top + 1) * batch_block_size)
+                blocks.resize((top + 1) * batch_block_size);
+            return block(top++);
+        }
+
+        void push_leaf(const Node *node, const double *const *columns, size_t offset, size_t count) {
+            double *out = push_block();
+            if (node->type == engine::number_node) {
+                std::fill(out, out + count, static_cast<const NumberNode *>(node)->number);
+            } else if (node->type == engine::variable_node) {
+                const double *column = columns[static_cast<const VariableNode *>(node)->slot] + offset;
+                std::copy(column, column + count, out);
+            } else {
+                // функция без аргументов
+                auto call = static_cast<const CallNode *>(node);
+                for (size_t i = 0; i < count; i++)
+                    out[i] = call->function->call(nullptr);
+            }
+        }
+
+        // Аргументы - argument_count верхних блоков, результат - в блок первого
+        void apply_call(const CallNode *call, size_t count) {
+            size_t first = top - call->argument_count;
+            const double *arguments[max_arguments];
+            for (size_t i = 0; i < call->argument_count; i++)
+                arguments[i] = block(first + i);
+            double *out = block(first);
+
+            if (call->function->batch != nullptr) {
+                call->function->call_batch(arguments, out, count);
+            } else {
+                double values[max_arguments];
+                for (size_t row = 0; row < count; row++) {
+                    for (size_t i = 0; i < call->argument_count; i++)
+                        values[i] = arguments[i][row];
+                    out[row] = call->function->call(values);
+                }
+            }
+            top = first + 1;
+        }
+
+        static void apply_binary_block(Token operation, double *left, const double *right, size_t count) {
+            const auto &kernels = simd::kernels();
+            switch (operation) {
+                case engine::addition:
+                    kernels.add(left, right, left, count);
+                    return;
+                case engine::subtraction:
+                    kernels.sub(left, right, left, count);
+                    return;
+                case engine::multiplication:
+                    kernels.mul(left, right, left, count);
+                    return;
+                case engine::division:
+                    kernels.div(left, right, left, count);
+                    return;
+                default:
+                    for (size_t i = 0; i < count; i++)
+                        left[i] = apply_binary(operation, left[i], right[i]);
+                    return;
+            }
+        }
+
+        // Степень с постоянным показателем без вызова pow, false - если сократить нельзя
+        static bool power_block(const BinaryOperationNode *binary, double *out, size_t count) {
+            if (binary->right_leaf->type != engine::number_node)
+                return false;
+            double exponent = static_cast<const NumberNode *>(binary->right_leaf)->number;
+            if (reduce_power(exponent) == engine::no_reduction)
+                return false;
+            for (size_t i = 0; i < count; i++)
+                out[i] = exponentiate(out[i], exponent);
+            return true;
+        }
+    };
+
+    // Разобранное выражение: владеет всеми своими нодами через арену
+    class Expression {
+    public:
+        Arena arena;
+        Node *root = nullptr;
+        // сколько слотов переменных было объявлено на момент разбора
+        size_t variable_count = 0;
+        // есть общие поддеревья (root - DAG), Program считает их один раз
+        bool shared = false;
+
+        // Работает на любой глубине дерева, в отличие от рекурсивного root->eval()
+        double eval(const double *variables = nullptr) {
+            static thread_local Evaluator evaluator;
+            return evaluator.eval(root, variables);
+        }
+
+        /*
+         * Считает выражение для n строк: columns[slot][row] - значение переменной,
+         * результат строки row пишется в out[row].
+         * Дерево обходится один раз на блок строк, а не на каждую строку
+         * */
+        void eval_batch(const double *const *columns, size_t n, double *out) {
+            static thread_local BlockEvaluator evaluator;
+            for (size_t offset = 0; offset < n; offset += batch_block_size) {
+                size_t count = std::min(batch_block_size, n - offset);
+                evaluator.eval(root, columns, offset, count, out + offset);
+            }
+        }
+    };
+
+    /*
+     * Хеш-консинг: структурно одинаковые ноды создаются в арене один раз.
+     * Операнды уже общие, поэтому хеш и сравнение смотрят только на саму ноду
+     * и указатели на операнды - O(1) на ноду, и одинаковые поддеревья - это один указатель.
+     * Дерево превращается в граф без циклов (DAG): у общей ноды несколько родителей
+     * */
+    class NodeInterner {
+    public:
+        explicit NodeInterner(Arena *arena) {
+            this->arena = arena;
+        }
+
+        Node *number(double value) {
+            NumberNode candidate(value);
+            return find_or_add(candidate);
+        }
+
+        Node *variable(size_t slot) {
+            VariableNode candidate(slot);
+            return find_or_add(candidate);
+        }
+
+        Node *unary(Node *right, Token operation) {
+            UnaryOperationNode candidate(right, operation);
+            return find_or_add(candidate);
+        }
+
+        Node *binary(Node *left, Node *right, Token operation) {
+            BinaryOperationNode candidate(left, right, operation);
+            return find_or_add(candidate);
+        }
+
+        // arguments копируются в арену, только если такого вызова еще не было
+        Node *call(const Function *function, Node *const *arguments) {
+            CallNode candidate(function, const_cast<Node **>(arguments));
+            Node *&entry = find_slot(&candidate);
+            if (entry != nullptr)
+                return entry;
+
+            Node **copy = arena->make_array<Node *>(function->arity);
+            std::copy(arguments, arguments + function->arity, copy);
+            entry = arena->make<CallNode>(function, copy);
+            count++;
+            return entry;
+        }
+
+        // Пересобирает дерево из общих нод, без рекурсии
+        Node *intern(const Node *root) {
+            struct Frame {
+                const Node *node;
+                // сколько операндов уже пересобрано, их ноды - на вершине shared
+                size_t done;
+            };
+            std::vector<Frame> frames = {{root, 0}};
+            std::vector<Node *> shared;
+
+            while (!frames.empty()) {
+                Frame &frame = frames.back();
+                if (frame.done < operand_count(frame.node)) {
+                    const Node *next = operand(frame.node, frame.done++);
+                    frames.push_back({next, 0});
+                    continue;
+                }
+
+                size_t count = frame.done;
+                Node *node = rebuild(frame.node, shared.data() + shared.size() - count);
+                frames.pop_back();
+                shared.resize(shared.size() - count);
+                shared.push_back(node);
+            }
+            return shared.back();
+        }
+
+        // Сколько разных нод создано
+        size_t size() const {
+            return count;
+        }
+
+        // Забывает все ноды, новые создаются в arena. Память таблицы остается для следующего разбора
+        void reset(Arena *arena) {
+            this->arena = arena;
+            std::fill(table.begin(), table.end(), nullptr);
+            count = 0;
+        }
+
+    private:
+        struct Hash {
+            size_t operator()(const Node *node) const {
+                uint64_t hash = node->type;
+                auto mix = [&hash](uint64_t value) {
+                    hash = (hash ^ value) * 0x9E3779B97F4A7C15ULL;
+                    hash ^= hash >> 29;
+                };
+
+                switch (node->type) {
+                    case engine::number_node: {
+                        double number = static_cast<const NumberNode *>(node)->number;
+                        uint64_t bits;
+                        std::memcpy(&bits, &number, sizeof(bits));
+                        mix(bits);
+                        break;
+                    }
+                    case engine::variable_node:
+                        mix(static_cast<const VariableNode *>(node)->slot);
+                        break;
+                    case engine::unary_operation_node:
+                        mix(static_cast<const UnaryOperationNode *>(node)->operation);
+                        break;
+                    case engine::binary_operation_node:
+                        mix(static_cast<const BinaryOperationNode *>(node)->operation);
+                        break;
+                    case engine::call_node:
+                        mix(reinterpret_cast<uintptr_t>(static_cast<const CallNode *>(node)->function));
+                        break;
+                }
+                for (size_t i = 0; i < operand_count(node); i++)
+                    mix(reinterpret_cast<uintptr_t>(operand(node, i)));
+                // таблица берет младшие биты, в них перемешиваются старшие
+                hash ^= hash >> 32;
+                hash *= 0xD6E8FEB86659FD93ULL;
+                hash ^= hash >> 32;
+                return (size_t) hash;
+            }
+        };
+
+        struct Equal {
+            bool operator()(const Node *left, const Node *right) const {
+                if (left->type != right->type)
+                    return false;
+
+                switch (left->type) {
+                    case engine::number_node: {
+                        // по битам: 0 и -0 - разные константы, одинаковые NaN - одна
+                        double a = static_cast<const NumberNode *>(left)->number;
+                        double b = static_cast<const NumberNode *>(right)->number;
+                        return std::memcmp(&a, &b, sizeof(a)) == 0;
+                    }
+                    case engine::variable_node:
+                        return static_cast<const VariableNode *>(left)->slot
+                               == static_cast<const VariableNode *>(right)->slot;
+                    case engine::unary_operation_node:
+                        if (static_cast<const UnaryOperationNode *>(left)->operation
+                            != static_cast<const UnaryOperationNode *>(right)->operation)
+                            return false;
+                        break;
+                    case engine::binary_operation_node:
+                        if (static_cast<const BinaryOperationNode *>(left)->operation
+                            != static_cast<const BinaryOperationNode *>(right)->operation)
+                            return false;
+                        break;
+                    case engine::call_node:
+                        if (static_cast<const CallNode *>(left)->function
+                            != static_cast<const CallNode *>(right)->function)
+                            return false;
+                        break;
+                }
+                for (size_t i = 0; i < operand_count(left); i++) {
+                    if (operand(left, i) != operand(right, i))
+                        return false;
+                }
+                return true;
+            }
+        };
+
+        Arena *arena;
+        // открытая адресация без аллокации на ноду, nullptr - свободная ячейка
+        std::vector<Node *> table;
+        size_t count = 0;
+
+        // Ячейка с такой же нодой или свободная ячейка, куда ее положить
+        Node *&find_slot(const Node *node) {
+            // заполнено не больше половины, чтобы цепочки проб были короткими
+            if (2 * (count + 1) > table.size())
+                grow();
+
+            size_t mask = table.size() - 1;
+            for (size_t i = Hash()(node) & mask;; i = (i + 1) & mask) {
+                Node *&entry = table[i];
+                if (entry == nullptr || Equal()(entry, node))
+                    return entry;
+            }
+        }
+
+        void grow() {
+            std::vector<Node *> old(std::max<size_t>(64, 2 * table.size()), nullptr);
+            table.swap(old);
+
+            size_t mask = table.size() - 1;
+            for (Node *node : old) {
+                if (node == nullptr)
+                    continue;
+                size_t i = Hash()(node) & mask;
+                while (table[i] != nullptr)
+                    i = (i + 1) & mask;
+                table[i] = node;
+            }
+        }
+
+        template<typename T>
+        Node *find_or_add(T &candidate) {
+            Node *&entry = find_slot(&candidate);
+            if (entry == nullptr) {
+                entry = arena->make<T>(candidate);
+                count++;
+            }
+            return entry;
+        }
+
+        // Та же нода, но с общими операндами
+        Node *rebuild(const Node *node, Node *const *operands) {
+            switch (node->type) {
+                case engine::number_node:
+                    return number(static_cast<const NumberNode *>(node)->number);
+                case engine::variable_node:
+                    return variable(static_cast<const VariableNode *>(node)->slot);
+                case engine::unary_operation_node:
+                    return unary(operands[0], static_cast<const UnaryOperationNode *>(node)->operation);
+                case engine::binary_operation_node:
+                    return binary(operands[0], operands[1], static_cast<const BinaryOperationNode *>(node)->operation);
+                default:
+                    return call(static_cast<const CallNode *>(node)->function, operands);
+            }
+        }
+    };
+
+    // Оператор, который ждет свои операнды
+    struct PendingOperator {
+        Token token = engine::eof;
+        // у открытой скобки 0
+        int precedence = 0;
+        bool unary = false;
+        // для скобки вызова: функция и сколько операндов было до ее аргументов
+        const Function *function = nullptr;
+        size_t first_argument = 0;
+
+        constexpr bool operator==(const PendingOperator &) const = default;
+    };
+
+    /*
+     * Разбор без рекурсии (сортировочная станция): операнды и операторы
+     * лежат на явных стеках, поэтому глубина скобок и цепочек унарных минусов
+     * ограничена только памятью. Приоритеты и ассоциативность бинарных
+     * операторов берутся из operator_table.
+     *
+     * Одна грамматика на всех: Parser, разбор при компиляции (static_expression.h)
+     * и IncrementalParser, который продолжает разбор с сохраненного состояния.
+     * lexer - токены как у Tokenizer: current_token, number, name, next_token().
+     * Что собирать, решает builder, он сам держит операнды на своем стеке:
+     * number(value), variable(name), operation(token, unary) - над верхними операндами,
+     * call(function, count) - над count верхними, find_function(name) - функция или nullptr,
+     * parsed_group() - готовый операнд для токена parsed_group, если lexer такие дает
+     * */
+    struct ParseState {
+        std::vector<PendingOperator> operators;
+        // сколько операндов сейчас на стеке builder
+        size_t operand_count = 0;
+        // сколько открытых скобок лежит на стеке операторов
+        size_t open_parentheses = 0;
+        // ждем операнд (число, имя, скобку, унарный знак) или бинарный оператор
+        bool expect_operand = true;
+
+        constexpr void clear() {
+            operators.clear();
+            operand_count = 0;
+            open_parentheses = 0;
+            expect_operand = true;
+        }
+
+        /*
+         * Читает токены, пока они продолжают выражение, и останавливается на первом,
+         * который не продолжает (eof, лишняя скобка, мусор). Если такой токен пришел,
+         * когда ждали оператор, с этого места можно продолжить, вызвав parse_tokens() еще раз
+         * */
+        template<typename Lexer, typename Builder>
+        constexpr void parse_tokens(Lexer &lexer, Builder &builder) {
+            while (true) {
+                Token token = lexer.current_token;
+
+                if (expect_operand) {
+                    switch (token) {
+                        case engine::addition:
+                            // унарный плюс ничего не делает
+                            break;
+                        case engine::subtraction:
+                            operators.push_back({engine::subtraction, unary_precedence, true});
+                            break;
+                        case engine::opened_parentheses:
+                            operators.push_back({engine::opened_parentheses, 0, false});
+                            open_parentheses++;
+                            break;
+                        case engine::number:
+                            builder.number(lexer.number);
+                            operand_count++;
+                            expect_operand = false;
+                            break;
+                        case engine::identifier: {
+                            std::string_view name = lexer.name;
+                            lexer.next_token();
+
+                            // имя со скобкой - вызов, аргументы собираются как в обычных скобках
+                            if (lexer.current_token == engine::opened_parentheses) {
+                                const Function *function = builder.find_function(name);
+                                if (function == nullptr)
+                                    throw std::logic_error("Unknown function");
+                                operators.push_back({engine::opened_parentheses, 0, false, function, operand_count});
+                                open_parentheses++;
+                                break;
+                            }
+
+                            builder.variable(name);
+                            operand_count++;
+                            expect_operand = false;
+                            continue;
+                        }
+                        case engine::closed_parentheses:
+                            // f() - вызов без аргументов
+                            if (operators.empty() || operators.back().function == nullptr
+                                || operators.back().first_argument != operand_count)
+                                throw std::logic_error("Unexpected token");
+                            close_parentheses(builder);
+                            expect_operand = false;
+                            break;
+                        case engine::parsed_group:
+                            if constexpr (requires { builder.parsed_group(); }) {
+                                builder.parsed_group();
+                                operand_count++;
+                                expect_operand = false;
+                                break;
+                            }
+                            throw std::logic_error("Unexpected token");
+                        default:
+                            throw std::logic_error("Unexpected token");
+                    }
+                    lexer.next_token();
+                    continue;
+                }
+
+                const OperatorInfo &info = operator_table[token];
+                if (info.precedence > 0) {
+                    /*
+                     * все, что связывает сильнее (а для левоассоциативных и так же),
+                     * уже можно собрать; у скобки приоритет 0, на ней останавливаемся
+                     * */
+                    int limit = info.right_associative ? info.precedence + 1 : info.precedence;
+                    while (!operators.empty() && operators.back().precedence >= limit)
+                        reduce(builder);
+
+                    operators.push_back({token, info.precedence, false});
+                    lexer.next_token();
+                    expect_operand = true;
+                    continue;
+                }
+
+                if (token == engine::closed_parentheses && open_parentheses > 0) {
+                    while (operators.back().token != engine::opened_parentheses)
+                        reduce(builder);
+                    close_parentheses(builder);
+
+                    lexer.next_token();
+                    continue;
+                }
+
+                if (token == engine::comma && open_parentheses > 0) {
+                    // аргумент готов, он остается на стеке операндов
+                    while (operators.back().token != engine::opened_parentheses)
+                        reduce(builder);
+                    if (operators.back().function == nullptr)
+                        throw std::logic_error("Unexpected token");
+
+                    lexer.next_token();
+                    expect_operand = true;
+                    continue;
+                }
+
+                // дальше не наше выражение: лишняя скобка, eof или мусор
+                return;
+            }
+        }
+
+        // Собирает все, что осталось на стеке: выражение кончилось
+        template<typename Builder>
+        constexpr void finish(Builder &builder) {
+            while (!operators.empty()) {
+                if (operators.back().token == engine::opened_parentheses)
+                    throw std::logic_error("Missing parentheses");
+                reduce(builder);
+            }
+        }
+
+    private:
+        // Снимает верхний оператор и собирает его над операндами
+        template<typename Builder>
+        constexpr void reduce(Builder &builder) {
+            PendingOperator pending = operators.back();
+            operators.pop_back();
+            builder.operation(pending.token, pending.unary);
+            if (!pending.unary)
+                operand_count--;
+        }
+
+        // Снимает открытую скобку; скобка вызова собирает аргументы в вызов
+        template<typename Builder>
+        constexpr void close_parentheses(Builder &builder) {
+            PendingOperator pending = operators.back();
+            operators.pop_back();
+            open_parentheses--;
+            if (pending.function == nullptr)
+                return;
+
+            size_t count = operand_count - pending.first_argument;
+            if (count != pending.function->arity)
+                throw std::logic_error("Wrong number of arguments");
+            builder.call(pending.function, count);
+            operand_count = pending.first_argument + 1;
+        }
+    };
+
+    /*
+     * Разбирает выражение с текущего токена до первого, который его не продолжает;
+     * проверить, что это eof, - дело вызывающего. state переиспользует память стека
+     * */
+    template<typename Lexer, typename Builder>
+    constexpr void parse_operators(Lexer &lexer, Builder &builder, ParseState &state) {
+        state.clear();
+        state.parse_tokens(lexer, builder);
+        state.finish(builder);
+    }
+
+    class Parser {
+    public:
+        double answer = 0;
+        Tokenizer *tokenizer;
+        // арена выражения, которое сейчас разбирается
+        Arena *arena = nullptr;
+        // имена переменных, индекс в векторе - номер слота
+        std::vector<std::string> variables;
+        // встретились ли переменные в последнем разобранном выражении
+        bool uses_variables = false;
+        /*
+         * Одинаковые поддеревья сразу собираются в одну ноду (NodeInterner): повторяющиеся
+         * выражения занимают меньше памяти, равные поддеревья - это равные указатели.
+         * Разобранное выражение - DAG с shared = true
+         * */
+        bool intern_nodes = false;
+
+        explicit Parser(Tokenizer *tokenizer) {
+            this->tokenizer = tokenizer;
+        }
+
+        /*
+         * Объявляет переменную и возвращает ее слот.
+         * Необъявленные имена получают слоты по порядку появления при разборе
+         * */
+        size_t declare_variable(std::string_view name) {
+            auto found = slots.find(name);
+            if (found != slots.end())
+                return found->second;
+
+            variables.emplace_back(name);
+            // ключи slots смотрят в slot_names: дек не двигает строки при росте
+            slots.emplace(slot_names.emplace_back(name), variables.size() - 1);
+            return variables.size() - 1;
+        }
+
+        // Забывает все слоты переменных
+        void clear_variables() {
+            variables.clear();
+            slots.clear();
+            slot_names.clear();
+        }
+
+        /*
+         * Регистрирует функцию для вызовов name(...): указатель на функцию или объект
+         * с константным operator(), все параметры - double. Число аргументов известно при компиляции,
+         * при разборе вызов сразу получает свою Function, при вычислении имя не ищется.
+         * Функция должна быть чистой: вызов с константными аргументами оптимизатор сворачивает.
+         * Пользовательские функции перекрывают встроенные, повторная регистрация - прежнюю
+         * (уже разобранные выражения продолжают звать старую). Выражения с вызовами
+         * ссылаются на функции парсера и не должны его переживать
+         * */
+        template<typename Scalar>
+        const Function &define_function(std::string_view name, Scalar scalar) {
+            return define_function(name, std::move(scalar), nullptr);
+        }
+
+        /*
+         * То же с пакетным вариантом для eval_batch:
+         * batch(const double *const *arguments, double *out, size_t count), как у BatchFunction
+         * */
+        template<typename Scalar, typename Batch>
+        const Function &define_function(std::string_view name, Scalar scalar, Batch batch) {
+            using Stored = detail::UserFunction<std::decay_t<Scalar>, std::decay_t<Batch>>;
+            static_assert(Stored::arity <= max_arguments, "Too many function arguments");
+            static_assert(detail::callable_with_doubles<std::decay_t<Scalar>>(std::make_index_sequence<Stored::arity>()),
+                          "Function must take doubles and return double");
+
+            BatchFunction batch_function = nullptr;
+            if constexpr (!std::is_same_v<std::decay_t<Batch>, std::nullptr_t>) {
+                static_assert(std::is_invocable_v<const std::decay_t<Batch> &, const double *const *, double *, size_t>,
+                              "Batch function must take (const double *const *, double *, size_t)");
+                batch_function = &Stored::call_batch;
+            }
+
+            auto stored = std::make_shared<const Stored>(Stored{std::move(scalar), std::move(batch)});
+            function_contexts.push_back(stored);
+
+            // ключи user_function_index и имена функций смотрят в function_names
+            std::string_view stored_name = function_names.emplace_back(name);
+            user_functions.push_back({stored_name, Stored::arity, &Stored::call_scalar, batch_function, stored.get()});
+            user_function_index[stored_name] = &user_functions.back();
+            return user_functions.back();
+        }
+
+        // Функция по имени или nullptr: сначала пользовательские, потом встроенные
+        const Function *find_function(std::string_view name) const {
+            auto found = user_function_index.find(name);
+            if (found != user_function_index.end())
+                return found->second;
+            return find_builtin(name);
+        }
+
+        void clear() {
+            this->tokenizer->position = 0;
+            this->tokenizer->current_char = 1;
+            this->tokenizer->current_token = engine::eof;
+        }
+
+        // Обрабатываем строку до конца
+        Expression parse_expression() {
+            Expression expression;
+            expression.root = parse_expression(expression.arena);
+            expression.variable_count = variables.size();
+            expression.shared = intern_nodes;
+            return expression;
+        }
+
+        /*
+         * Разбирает выражение в чужую арену.
+         * Удобно, когда одна арена через reset() переиспользуется для многих выражений
+         * */
+        Node *parse_expression(Arena &target) {
+            this->arena = &target;
+            this->uses_variables = false;
+            if (intern_nodes)
+                interner.reset(&target);
+
+            Node *root = parse_operators();
+            this->arena = nullptr;
+
+            if (tokenizer->current_token != engine::eof)
+                throw std::logic_error("Not understandable expression");
+
+            clear();
+
+            // без значений переменных посчитать ответ сразу нельзя
+            this->answer = uses_variables ? std::nan("") : evaluator.eval(root, nullptr);
+            return root;
+        }
+
+        // Разбирает выражение с текущего токена до первого лишнего, см. engine::parse_operators()
+        Node *parse_operators() {
+            operands.clear();
+            NodeBuilder builder{this};
+            engine::parse_operators(*tokenizer, builder, state);
+            return operands.back();
+        }
+
+    private:
+        // Собирает ноды для engine::parse_operators() в арене разбора
+        struct NodeBuilder {
+            Parser *parser;
+
+            void number(double value) {
+                parser->operands.push_back(parser->make_number(value));
+            }
+
+            void variable(std::string_view name) {
+                parser->operands.push_back(parser->make_variable(parser->declare_variable(name)));
+                parser->uses_variables = true;
+            }
+
+            void operation(Token token, bool unary) {
+                auto &operands = parser->operands;
+                Node *right = operands.back();
+                operands.pop_back();
+
+                if (unary) {
+                    operands.push_back(parser->intern_nodes ? parser->interner.unary(right, token)
+                                                            : parser->arena->make<UnaryOperationNode>(right, token));
+                    return;
+                }
+                Node *left = operands.back();
+                operands.back() = parser->intern_nodes ? parser->interner.binary(left, right, token)
+                                                       : parser->arena->make<BinaryOperationNode>(left, right, token);
+            }
+
+            void call(const Function *function, size_t count) {
+                auto &operands = parser->operands;
+                size_t first = operands.size() - count;
+
+                Node *call;
+                if (parser->intern_nodes) {
+                    call = parser->interner.call(function, operands.data() + first);
+                } else {
+                    Node **arguments = parser->arena->make_array<Node *>(count);
+                    std::copy(operands.begin() + (std::ptrdiff_t) first, operands.end(), arguments);
+                    call = parser->arena->make<CallNode>(function, arguments);
+                }
+                operands.resize(first);
+                operands.push_back(call);
+            }
+
+            const Function *find_function(std::string_view name) const {
+                return parser->find_function(name);
+            }
+        };
+
+        std::vector<Node *> operands;
+        ParseState state;
+        Evaluator evaluator;
+        // таблица общих нод для intern_nodes, переиспользуется между разборами
+        NodeInterner interner{nullptr};
+
+        Node *make_number(double number) {
+            return intern_nodes ? interner.number(number) : arena->make<NumberNode>(number);
+        }
+
+        Node *make_variable(size_t slot) {
+            return intern_nodes ? interner.variable(slot) : arena->make<VariableNode>(slot);
+        }
+
+        std::deque<std::string> slot_names;
+        std::unordered_map<std::string_view, size_t> slots;
+
+        // дек не двигает элементы при росте: на них указывают ноды вызовов
+        std::deque<std::string> function_names;
+        std::deque<Function> user_functions;
+        std::vector<std::shared_ptr<const void>> function_contexts;
+        std::unordered_map<std::string_view, const Function *> user_function_index;
+    };
+}
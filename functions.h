@@ -0,0 +1,151 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "simd.h"
+#include "vector_math.h"
+
+
+namespace engine {
+    /*
+     * Вызов для одной строки: arguments - значения аргументов по порядку,
+     * context - Function::context (состояние пользовательской функции)
+     * */
+    using ScalarFunction = double (*)(const void *context, const double *arguments);
+
+    /*
+     * Вызов для блока строк: arguments[i] - блок значений i-го аргумента.
+     * out может совпадать с arguments[0]
+     * */
+    using BatchFunction = void (*)(const void *context, const double *const *arguments, double *out, size_t count);
+
+    // Больше аргументов у функции быть не может: место под них берется на стеке
+    constexpr size_t max_arguments = 16;
+
+    struct Function {
+        std::string_view name;
+        size_t arity;
+        ScalarFunction scalar;
+        // nullptr - пакетное вычисление зовет scalar для каждой строки
+        BatchFunction batch;
+        const void *context = nullptr;
+
+        double call(const double *arguments) const {
+            return scalar(context, arguments);
+        }
+
+        void call_batch(const double *const *arguments, double *out, size_t count) const {
+            batch(context, arguments, out, count);
+        }
+    };
+
+    /*
+     * Встроенные функции. Одиночный вызов считает libm, пакетный - ядра simd::kernels():
+     * на AVX2 и AVX-512 это полиномы engine::math, они расходятся с libm в последнем бите.
+     * min и max возвращают NaN, если он есть среди аргументов
+     * */
+#define ENGINE_UNARY_BUILTIN(function_name, scalar_function)                         \
+        Function{#function_name, 1, [](const void *, const double *arguments) {      \
+            return scalar_function(arguments[0]);                                    \
+        }, [](const void *, const double *const *arguments, double *out, size_t count) { \
+            simd::kernels().function_name(arguments[0], out, count);                 \
+        }}
+
+#define ENGINE_BINARY_BUILTIN(function_name, scalar_function)                        \
+        Function{#function_name, 2, [](const void *, const double *arguments) {      \
+            return scalar_function(arguments[0], arguments[1]);                      \
+        }, [](const void *, const double *const *arguments, double *out, size_t count) { \
+            simd::kernels().function_name(arguments[0], arguments[1], out, count);   \
+        }}
+
+    // Таблица известна при компиляции: вызов встроенной функции по постоянному индексу встраивается
+    inline constexpr std::array<Function, 10> builtin_table = {
+            ENGINE_UNARY_BUILTIN(sin, std::sin),
+            ENGINE_UNARY_BUILTIN(cos, std::cos),
+            ENGINE_UNARY_BUILTIN(exp, std::exp),
+            ENGINE_UNARY_BUILTIN(log, std::log),
+            ENGINE_UNARY_BUILTIN(sqrt, std::sqrt),
+            ENGINE_UNARY_BUILTIN(abs, std::fabs),
+            ENGINE_UNARY_BUILTIN(floor, std::floor),
+            ENGINE_UNARY_BUILTIN(ceil, std::ceil),
+            ENGINE_BINARY_BUILTIN(min, math::min),
+            ENGINE_BINARY_BUILTIN(max, math::max),
+    };
+
+    constexpr const std::array<Function, 10> &builtin_functions() {
+        return builtin_table;
+    }
+
+#undef ENGINE_UNARY_BUILTIN
+#undef ENGINE_BINARY_BUILTIN
+
+    // Встроенная функция по имени или nullptr
+    constexpr const Function *find_builtin(std::string_view name) {
+        for (const auto &function : builtin_functions()) {
+            if (function.name == name)
+                return &function;
+        }
+        return nullptr;
+    }
+
+    namespace detail {
+        // Число параметров функции или operator() вызываемого объекта
+        template<typename Signature>
+        struct Arity;
+
+        template<typename Result, typename... Parameters>
+        struct Arity<Result (*)(Parameters...)> {
+            static constexpr size_t value = sizeof...(Parameters);
+        };
+
+        template<typename Result, typename... Parameters>
+        struct Arity<Result (*)(Parameters...) noexcept> : Arity<Result (*)(Parameters...)> {};
+
+        template<typename Result, typename Class, typename... Parameters>
+        struct Arity<Result (Class::*)(Parameters...) const> : Arity<Result (*)(Parameters...)> {};
+
+        template<typename Result, typename Class, typename... Parameters>
+        struct Arity<Result (Class::*)(Parameters...) const noexcept> : Arity<Result (*)(Parameters...)> {};
+
+        template<typename Callable, typename = void>
+        struct CallableArity : Arity<decltype(&Callable::operator())> {};
+
+        template<typename Callable>
+        struct CallableArity<Callable, std::enable_if_t<std::is_pointer_v<Callable>>> : Arity<Callable> {};
+
+        template<size_t>
+        using Double = double;
+
+        template<typename Callable, size_t... Indices>
+        constexpr bool callable_with_doubles(std::index_sequence<Indices...>) {
+            return std::is_invocable_r_v<double, const Callable &, Double<Indices>...>;
+        }
+
+        // Пользовательская функция и ее пакетный вариант (std::nullptr_t - его нет)
+        template<typename Scalar, typename Batch>
+        struct UserFunction {
+            Scalar scalar;
+            Batch batch;
+
+            static constexpr size_t arity = CallableArity<Scalar>::value;
+
+            template<size_t... Indices>
+            static double call(const void *context, const double *arguments, std::index_sequence<Indices...>) {
+                return static_cast<const UserFunction *>(context)->scalar(arguments[Indices]...);
+            }
+
+            static double call_scalar(const void *context, const double *arguments) {
+                return call(context, arguments, std::make_index_sequence<arity>());
+            }
+
+            static void call_batch(const void *context, const double *const *arguments, double *out, size_t count) {
+                static_cast<const UserFunction *>(context)->batch(arguments, out, count);
+            }
+        };
+    }
+}
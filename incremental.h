@@ -0,0 +1,1262 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "engine.h"
+
+
+namespace engine {
+    /*
+     * Разбор текста, который правят по кусочку, как в редакторе формул.
+     * Текст хранится деревом групп: группа - уровень между парой скобок (корень - весь текст),
+     * ее элементы - токены этого уровня и вложенные группы целиком. Позиции элементов считаются
+     * от начала своей группы, поэтому правка не сдвигает позиции в других группах.
+     * Уровень разбирает та же сортировочная станция, что и Parser (ParseState),
+     * вложенная группа приходит в нее одним готовым операндом.
+     *
+     * Правка (offset, removed, inserted) заново токенизирует только кусок самой вложенной группы,
+     * внутри скобок которой лежит: от токена у начала правки до места, где новые токены сошлись
+     * со старыми. Разбор уровня каждые checkpoint_interval элементов сохраняет свое состояние,
+     * поэтому уровень продолжается с последнего состояния перед правкой и останавливается,
+     * как только после правки состояние совпало со старым: дальше старые ноды верны,
+     * новые операнды со стека кладутся на места старых. Новое значение группы так же кладется
+     * на ее место в родителе, предков заново не разбираем. Стоимость правки - ее размер
+     * и расстояние между сохраненными состояниями, а не длина уровня.
+     *
+     * '(' без пары - группа до конца текста, лишняя ')' - элемент корня, токен, на котором
+     * Tokenizer бросает ошибку, - элемент, на котором ее бросит разбор уровня. Правка, которая
+     * меняет пары скобок вокруг себя, токенизирует заново уровень выше.
+     * Разбор уровня с ошибкой запоминает ее и элемент, где остановился, и сохраняет состояния
+     * до него. Правка бросает logic_error с той ошибкой, что раньше всех в тексте: ее первой
+     * нашел бы Parser, и текст у нее тот же. Правка при этом остается в тексте, и следующая
+     * продолжает с него.
+     * Переменные, объявленные в parser до set_text(), сохраняют его слоты, остальные получают
+     * свои по порядку появления, функции ищутся в parser. Слот имени, которое больше не переменная,
+     * освобождается, и его получает следующее новое имя
+     * */
+    class IncrementalParser {
+    public:
+        explicit IncrementalParser(Parser *parser) {
+            this->parser = parser;
+        }
+
+        // Разбирает новый текст целиком
+        void set_text(std::string_view text) {
+            this->source.assign(text);
+
+            names.clear();
+            slot_names = parser->variables;
+            declared_count = slot_names.size();
+            free_slots = {};
+            for (size_t slot = 0; slot < slot_names.size(); slot++)
+                names.emplace(slot_names[slot], Name{.slot = slot, .declared = true});
+
+            rebuild();
+            finish_parse();
+        }
+
+        // Заменяет removed символов с позиции offset на inserted
+        void edit(size_t offset, size_t removed, std::string_view inserted) {
+            if (offset > source.size() || removed > source.size() - offset)
+                throw std::out_of_range("Edit is outside of the text");
+
+            source.replace(offset, removed, inserted);
+            // если relex() не дойдет до конца, дерево групп строится заново
+            bool relexed = valid;
+            valid = false;
+            root_node = nullptr;
+            if (relexed)
+                relex(offset, removed, inserted.size());
+            valid = true;
+
+            // ноды прошлых правок копятся в арене: когда их много, все группы разбираются в чистую
+            if (!relexed)
+                rebuild();
+            else if (arena.bytes_reserved() > 4 * compacted_bytes)
+                compact();
+            else
+                parse_pending();
+            finish_parse();
+        }
+
+        const std::string &text() const {
+            return source;
+        }
+
+        // nullptr, если текст не разобрался. Ноды живут до следующей правки
+        Node *root() const {
+            return root_node;
+        }
+
+        // Сколько значений ждет eval(): слоты переменных от 0 до variable_count() - 1
+        size_t variable_count() const {
+            return slot_names.size();
+        }
+
+        // Имена переменных по слотам; у свободного слота имя пустое
+        const std::vector<std::string> &variables() const {
+            return slot_names;
+        }
+
+        double eval(const double *variables = nullptr) {
+            if (root_node == nullptr)
+                throw std::logic_error("Text is not parsed");
+            return evaluator.eval(root_node, variables);
+        }
+
+    private:
+        static constexpr size_t no_group = std::numeric_limits<size_t>::max();
+        static constexpr size_t no_slot = std::numeric_limits<size_t>::max();
+        // ошибка уровня до его элементов: неизвестная функция перед '('
+        static constexpr size_t before_elements = std::numeric_limits<size_t>::max();
+        // через сколько элементов уровня разбор сохраняет состояние
+        static constexpr size_t checkpoint_interval = 16;
+        // состояние с более глубокими стеками не сохраняется
+        static constexpr size_t checkpoint_depth = 8;
+
+        // Имя из текста: uses - сколько раз оно там встречается, calls - из них перед скобками вызова
+        struct Name {
+            size_t uses = 0;
+            size_t calls = 0;
+            // слот нужен, пока имя встречается не только как имя функции
+            size_t slot = no_slot;
+            // объявлено в parser до set_text(): слот не освобождается
+            bool declared = false;
+            // уже лежит в unused_names
+            bool queued = false;
+        };
+
+        // поиск по string_view без временной строки
+        struct NameHash {
+            using is_transparent = void;
+
+            size_t operator()(std::string_view name) const {
+                return std::hash<std::string_view>()(name);
+            }
+        };
+
+        using NameTable = std::unordered_map<std::string, Name, NameHash, std::equal_to<>>;
+        using NameEntry = NameTable::value_type;
+
+        /*
+         * Токен уровня или вложенная группа целиком, от '(' до ')' или до конца текста
+         * (token == opened_parentheses). engine::eof - токен, на котором Tokenizer бросает ошибку,
+         * или символ, на котором для него кончается текст; в корне такой символ - последний элемент
+         * длины 0, текст за ним не разбирается
+         * */
+        struct Element {
+            // от начала своей группы
+            size_t offset = 0;
+            size_t length = 0;
+            Token token = engine::eof;
+            double number = 0;
+            // для engine::identifier; указатели на элементы unordered_map не меняются
+            NameEntry *name = nullptr;
+            size_t group = 0;
+        };
+
+        // Операнд на стеке разбора уровня и место, куда его забрал родитель
+        struct Cell {
+            Node *node = nullptr;
+            // поле ноды-родителя или value группы; nullptr, пока операнд никто не забрал
+            Node **holder = nullptr;
+            // группа, чье значение этот операнд
+            size_t group = no_group;
+        };
+
+        // Состояние разбора уровня перед элементом element: стеки операторов и операндов, они в арене
+        struct Checkpoint {
+            size_t element = 0;
+            size_t open_parentheses = 0;
+            size_t operator_count = 0;
+            size_t cell_count = 0;
+            PendingOperator *operators = nullptr;
+            Cell **cells = nullptr;
+        };
+
+        // Операнд восстановленного стека и его место до нового разбора
+        struct RestoredCell {
+            Cell *cell;
+            Node **holder;
+        };
+
+        struct Group {
+            std::vector<Element> elements;
+            // по возрастанию element
+            std::vector<Checkpoint> checkpoints;
+            // имя перед '(': группа - вызов этой функции
+            NameEntry *function = nullptr;
+            // значение скобок целиком, вместе с вызовом
+            Node *value = nullptr;
+            // операнд родительского уровня, который держит value
+            Cell *cell = nullptr;
+            size_t parent = no_group;
+            // номер ее элемента в родительском уровне
+            size_t element = 0;
+            // вложенность, корень - 0: дети разбираются раньше родителей
+            size_t depth = 0;
+            // элементы [changed_begin, changed_end) новые с прошлого разбора, остальные checkpoints верны
+            size_t changed_begin = 0;
+            size_t changed_end = 0;
+            // ошибка последнего разбора, пустая - ее нет
+            std::string error;
+            // элемент, на котором разбор остановился с ошибкой; elements.size() - конец группы
+            size_t error_element = 0;
+            // нашлась ')': иначе группа тянется до конца текста
+            bool closed = false;
+            bool parsed = false;
+            bool live = false;
+            // уже лежит в failed
+            bool listed = false;
+        };
+
+        // Конец правки: текст до old_end в старом тексте стал текстом до new_end в новом
+        struct Edit {
+            size_t old_end;
+            size_t new_end;
+        };
+
+        // Группа, чья '(' уже встретилась, а ')' еще нет
+        struct OpenGroup {
+            size_t group;
+            size_t begin;
+            // номер ее элемента в родительском уровне
+            size_t element;
+        };
+
+        // Шаг спуска к правке: группа и номер элемента вложенной группы в ней
+        struct PathStep {
+            size_t group;
+            size_t element;
+        };
+
+        // Группа, внутри скобок которой лежит правка: где она начинается и где кончается ее содержимое
+        struct Enclosing {
+            size_t group;
+            size_t base;
+            size_t end;
+            // номер вложенной группы на пути к правке
+            size_t element;
+        };
+
+        /*
+         * Токены уровня для ParseState. Вложенная группа - один токен parsed_group,
+         * вместе с именем функции перед ней; у группы-вызова сначала идут ее имя и '(', в конце ')',
+         * если она есть. На элементе с ошибкой Tokenizer бросает ее, как бросил бы Tokenizer в Parser.
+         * Перед элементом не раньше stop, где кончился операнд, отдает eof и ставит paused:
+         * разбор ждет оператор, и с этого места его можно продолжить
+         * */
+        struct LevelLexer {
+            IncrementalParser *owner;
+            size_t level;
+
+            Token current_token = engine::eof;
+            double number = 0;
+            std::string_view name = {};
+            // элемент текущего токена
+            size_t index = 0;
+            size_t stop = no_group;
+            // группа текущего токена parsed_group
+            size_t group = no_group;
+            bool paused = false;
+
+            enum Stage {
+                function_name,
+                opening,
+                elements,
+                closing,
+                end,
+            };
+            Stage stage = end;
+
+            // Первый токен уровня
+            void start() {
+                const Group &current = owner->groups[level];
+                if (current.parent == no_group) {
+                    seek(0);
+                } else if (current.function != nullptr) {
+                    stage = function_name;
+                    current_token = engine::identifier;
+                    name = current.function->first;
+                } else {
+                    stage = opening;
+                    current_token = engine::opened_parentheses;
+                }
+            }
+
+            // Токен элемента element
+            void seek(size_t element) {
+                stage = elements;
+                index = element;
+                read();
+            }
+
+            // Элемент, на котором стоит разбор; before_elements - имя функции или '(' перед элементами
+            size_t element() const {
+                return stage == function_name || stage == opening ? before_elements : index;
+            }
+
+            void next_token() {
+                switch (stage) {
+                    case function_name:
+                        stage = opening;
+                        current_token = engine::opened_parentheses;
+                        break;
+                    case opening:
+                        seek(0);
+                        break;
+                    case elements:
+                        index++;
+                        read();
+                        break;
+                    case closing:
+                        stage = end;
+                        current_token = engine::eof;
+                        break;
+                    case end:
+                        break;
+                }
+            }
+
+        private:
+            void read() {
+                const Group &current = owner->groups[level];
+                const auto &items = current.elements;
+                paused = false;
+
+                if (index >= items.size()) {
+                    stage = current.closed ? closing : end;
+                    current_token = stage == end ? engine::eof : engine::closed_parentheses;
+                    return;
+                }
+                if (index >= stop && pausable(items, index)) {
+                    paused = true;
+                    current_token = engine::eof;
+                    return;
+                }
+
+                // имя функции уже у группы-вызова
+                if (is_call_name(items, index))
+                    index++;
+                const Element &element = items[index];
+                switch (element.token) {
+                    case engine::opened_parentheses:
+                        current_token = engine::parsed_group;
+                        group = element.group;
+                        break;
+                    case engine::number:
+                        current_token = engine::number;
+                        number = element.number;
+                        break;
+                    case engine::identifier:
+                        current_token = engine::identifier;
+                        name = element.name->first;
+                        break;
+                    case engine::eof:
+                        owner->check_token(level, element);
+                        current_token = engine::eof;
+                        break;
+                    default:
+                        current_token = element.token;
+                }
+            }
+        };
+
+        // Собирает ноды уровня и помнит для каждого операнда, куда его забрали
+        struct LevelBuilder {
+            IncrementalParser *owner;
+            const LevelLexer *lexer;
+
+            void number(double value) {
+                push(owner->arena.make<NumberNode>(value));
+            }
+
+            void variable(std::string_view name) {
+                push(owner->arena.make<VariableNode>(owner->variable_slot(*owner->names.find(name))));
+            }
+
+            void parsed_group() {
+                Group &group = owner->groups[lexer->group];
+                push(group.value, lexer->group);
+                group.cell = owner->cells.back();
+            }
+
+            void operation(Token token, bool unary) {
+                auto &cells = owner->cells;
+                Cell *right = cells.back();
+                cells.pop_back();
+
+                if (unary) {
+                    auto node = owner->arena.make<UnaryOperationNode>(right->node, token);
+                    right->holder = &node->right_leaf;
+                    push(node);
+                    return;
+                }
+
+                Cell *left = cells.back();
+                cells.pop_back();
+                auto node = owner->arena.make<BinaryOperationNode>(left->node, right->node, token);
+                left->holder = &node->left_leaf;
+                right->holder = &node->right_leaf;
+                push(node);
+            }
+
+            void call(const Function *function, size_t count) {
+                auto &cells = owner->cells;
+                Node **arguments = owner->arena.make_array<Node *>(count);
+                size_t first = cells.size() - count;
+                for (size_t i = 0; i < count; i++) {
+                    arguments[i] = cells[first + i]->node;
+                    cells[first + i]->holder = &arguments[i];
+                }
+                cells.resize(first);
+                push(owner->arena.make<CallNode>(function, arguments));
+            }
+
+            const Function *find_function(std::string_view name) const {
+                return owner->parser->find_function(name);
+            }
+
+        private:
+            void push(Node *node, size_t group = no_group) {
+                owner->cells.push_back(owner->arena.make<Cell>(Cell{node, nullptr, group}));
+            }
+        };
+
+        Parser *parser;
+        std::string source;
+        Arena arena;
+        // прошлая арена: в ней ноды, которые видел вызывающий до последнего compact()
+        Arena spare_arena;
+        // размер арены после последней полной сборки
+        size_t compacted_bytes = Arena::default_block_size;
+        // группа 0 - корень; освобожденные номера переиспользуются
+        std::deque<Group> groups;
+        std::vector<size_t> free_groups;
+        // группы, которые надо разобрать заново, вложенные раньше внешних
+        std::vector<size_t> pending;
+        // pending не по порядку вложенности (после упавшего разбора или compact()), его надо отсортировать
+        bool pending_unsorted = false;
+        // дерево групп соответствует тексту
+        bool valid = false;
+        Node *root_node = nullptr;
+        Evaluator evaluator;
+
+        NameTable names;
+        // имя переменной по слоту, пустое - слот свободен
+        std::vector<std::string> slot_names;
+        // первые declared_count слотов - переменные parser
+        size_t declared_count = 0;
+        // свободные слоты, меньший отдается первым; номера за концом slot_names устарели
+        std::priority_queue<size_t, std::vector<size_t>, std::greater<>> free_slots;
+        // имена, которые с последней правки могли перестать быть переменными
+        std::vector<NameEntry *> unused_names;
+
+        // группы с ошибкой разбора; номера без ошибки убирает throw_first_error()
+        std::vector<size_t> failed;
+
+        std::vector<Enclosing> path;
+        std::vector<Element> fresh;
+        ParseState state;
+        std::vector<Cell *> cells;
+        // состояния, сохраненные текущим разбором уровня
+        std::vector<Checkpoint> saved;
+        // стек, с которого продолжен текущий разбор, и куда были забраны его операнды
+        std::vector<RestoredCell> restored;
+
+        void rebuild() {
+            valid = false;
+            root_node = nullptr;
+            arena.reset();
+            // группы остаются с памятью своих векторов, их снова раздает make_group()
+            free_groups.clear();
+            for (size_t group = groups.size(); group-- > 0;)
+                release_group(group);
+            for (size_t group : failed)
+                groups[group].listed = false;
+            failed.clear();
+            pending.clear();
+            pending_unsorted = false;
+            // имена пересчитываются заново, слоты оставшихся переменных не меняются
+            unused_names.clear();
+            for (auto &[text, name] : names)
+                name.uses = name.calls = 0;
+
+            size_t root = make_group(no_group);
+            fresh.clear();
+            lex(root, 0, 0, source.size(), fresh, nullptr, nullptr);
+            groups[root].elements = fresh;
+            pending.push_back(root);
+
+            for (auto entry = names.begin(); entry != names.end();) {
+                Name &name = entry->second;
+                if (!name.declared && name.uses == name.calls) {
+                    free_slot(name.slot);
+                    name.slot = no_slot;
+                }
+                if (!name.declared && name.uses == 0)
+                    entry = names.erase(entry);
+                else
+                    entry++;
+            }
+            assign_slots();
+            valid = true;
+
+            parse_pending();
+            compacted_bytes = std::max(arena.bytes_reserved(), Arena::default_block_size);
+        }
+
+        /*
+         * Разбирает все группы заново в другую арену, без токенизации.
+         * Разобранные группы после этого смотрят только в новую арену,
+         * поэтому старую можно очистить при следующем compact()
+         * */
+        void compact() {
+            std::swap(arena, spare_arena);
+            arena.reset();
+
+            pending.clear();
+            for (size_t group = 0; group < groups.size(); group++) {
+                Group &current = groups[group];
+                if (current.live) {
+                    // ячейки и состояния остались в старой арене
+                    current.checkpoints.clear();
+                    current.cell = nullptr;
+                    current.value = nullptr;
+                    current.parsed = false;
+                    pending.push_back(group);
+                }
+            }
+            pending_unsorted = true;
+            parse_pending();
+            compacted_bytes = std::max(arena.bytes_reserved(), Arena::default_block_size);
+        }
+
+        size_t make_group(size_t parent) {
+            size_t index;
+            if (free_groups.empty()) {
+                index = groups.size();
+                groups.emplace_back();
+            } else {
+                index = free_groups.back();
+                free_groups.pop_back();
+            }
+            Group &group = groups[index];
+            group.parent = parent;
+            group.depth = parent == no_group ? 0 : groups[parent].depth + 1;
+            group.closed = false;
+            group.live = true;
+            return index;
+        }
+
+        // Освобождает группу со всеми вложенными, без рекурсии
+        void free_group(size_t index) {
+            std::vector<size_t> stack = {index};
+            while (!stack.empty()) {
+                size_t current = stack.back();
+                stack.pop_back();
+                for (const auto &element : groups[current].elements) {
+                    if (element.token == engine::opened_parentheses)
+                        stack.push_back(element.group);
+                    else if (element.token == engine::identifier)
+                        drop_name(element.name);
+                }
+                set_function(current, nullptr);
+                release_group(current);
+            }
+        }
+
+        // Имена не трогает: их счетчики ведут free_group() и relex(), а rebuild() считает заново
+        void release_group(size_t index) {
+            Group &group = groups[index];
+            group.elements.clear();
+            group.checkpoints.clear();
+            group.function = nullptr;
+            group.value = nullptr;
+            group.cell = nullptr;
+            group.error.clear();
+            group.parsed = false;
+            group.live = false;
+            free_groups.push_back(index);
+        }
+
+        // Имя для элемента identifier
+        NameEntry *use_name(std::string_view text) {
+            auto entry = names.find(text);
+            if (entry == names.end())
+                entry = names.emplace(std::string(text), Name{}).first;
+            entry->second.uses++;
+            return &*entry;
+        }
+
+        void drop_name(NameEntry *entry) {
+            entry->second.uses--;
+            queue_unused(entry);
+        }
+
+        // Имя функции перед группой
+        void set_function(size_t group, NameEntry *function) {
+            NameEntry *&current = groups[group].function;
+            if (current == function)
+                return;
+            if (current != nullptr)
+                current->second.calls--;
+            if (function != nullptr) {
+                function->second.calls++;
+                queue_unused(function);
+            }
+            current = function;
+        }
+
+        void queue_unused(NameEntry *entry) {
+            Name &name = entry->second;
+            if (name.uses == name.calls && !name.declared && !name.queued) {
+                name.queued = true;
+                unused_names.push_back(entry);
+            }
+        }
+
+        // Освобождает слоты имен, которые больше не переменные, и убирает те, которых нет в тексте
+        void release_unused_names() {
+            for (NameEntry *entry : unused_names) {
+                Name &name = entry->second;
+                name.queued = false;
+                if (name.uses != name.calls)
+                    continue;
+                free_slot(name.slot);
+                name.slot = no_slot;
+                if (name.uses == 0)
+                    names.erase(entry->first);
+            }
+            unused_names.clear();
+        }
+
+        size_t variable_slot(NameEntry &entry) {
+            Name &name = entry.second;
+            if (name.slot != no_slot)
+                return name.slot;
+
+            // наименьший свободный слот внутри slot_names, иначе новый в конце
+            while (!free_slots.empty()
+                   && (free_slots.top() >= slot_names.size() || !slot_names[free_slots.top()].empty()))
+                free_slots.pop();
+            if (free_slots.empty()) {
+                name.slot = slot_names.size();
+                slot_names.push_back(entry.first);
+            } else {
+                name.slot = free_slots.top();
+                free_slots.pop();
+                slot_names[name.slot] = entry.first;
+            }
+            return name.slot;
+        }
+
+        void free_slot(size_t slot) {
+            if (slot == no_slot)
+                return;
+            slot_names[slot].clear();
+            free_slots.push(slot);
+            // свободные слоты в конце не нужны eval()
+            while (slot_names.size() > declared_count && slot_names.back().empty())
+                slot_names.pop_back();
+        }
+
+        // Слоты новым переменным в порядке появления в тексте, как у Parser
+        void assign_slots() {
+            std::vector<PathStep> stack = {{0, 0}};
+            while (!stack.empty()) {
+                PathStep &step = stack.back();
+                const auto &elements = groups[step.group].elements;
+                if (step.element == elements.size()) {
+                    stack.pop_back();
+                    continue;
+                }
+
+                size_t index = step.element++;
+                const Element &element = elements[index];
+                if (element.token == engine::opened_parentheses)
+                    stack.push_back({element.group, 0});
+                else if (element.token == engine::identifier && !is_call_name(elements, index))
+                    variable_slot(*element.name);
+            }
+        }
+
+        static bool is_call_name(const std::vector<Element> &elements, size_t index) {
+            return elements[index].token == engine::identifier && index + 1 < elements.size()
+                   && elements[index + 1].token == engine::opened_parentheses;
+        }
+
+        // Элементом index - 1 кончается операнд: перед index разбор ждет оператор
+        static bool pausable(const std::vector<Element> &elements, size_t index) {
+            if (index == 0)
+                return false;
+            switch (elements[index - 1].token) {
+                case engine::number:
+                case engine::opened_parentheses:
+                    return true;
+                case engine::identifier:
+                    return !is_call_name(elements, index - 1);
+                default:
+                    return false;
+            }
+        }
+
+        /*
+         * Токенизирует source[start, end) в элементы уровня level, который начинается в base.
+         * Вложенные группы создаются целиком, '(' без пары - группой до конца куска.
+         * Токен, на котором Tokenizer бросил ошибку, становится элементом eof, и Tokenizer
+         * начинает заново за ним. С edit это правка уровня old: разбор останавливается
+         * на первом токене после правки, который начинается там же, где старый элемент old[resume],
+         * сдвинутый правкой. resume - с какого старого элемента уровень идет без изменений
+         * (old.size(), если правка тянется до конца уровня). false - правка меняет скобки самого
+         * уровня: лишняя ')' не в корне или '(' без пары в группе с ')'
+         * */
+        bool lex(size_t level, size_t base, size_t start, size_t end, std::vector<Element> &out,
+                 const Edit *edit, const std::vector<Element> *old, size_t *resume = nullptr) {
+            // groups растет в make_group(), ссылки на уровень не держим
+            bool root = groups[level].parent == no_group;
+            bool closed_level = groups[level].closed;
+
+            std::vector<OpenGroup> open;
+            Tokenizer tokenizer;
+            // вход tokenizer начинается в source с origin
+            size_t origin = start;
+            Token token = engine::eof;
+            size_t token_begin = start;
+            size_t token_end = start;
+            // tokenizer бросил ошибку на токене [token_begin, token_end)
+            bool broken = false;
+            auto read = [&](bool restart) {
+                broken = false;
+                try {
+                    if (restart) {
+                        while (origin < end && source[origin] == ' ')
+                            origin++;
+                        token_begin = origin;
+                        tokenizer.set_input(std::string_view(source).substr(origin, end - origin));
+                    } else {
+                        while (tokenizer.current_char == ' ')
+                            tokenizer.next_char();
+                        token_begin = origin + (size_t) tokenizer.position - 1;
+                        tokenizer.next_token();
+                    }
+                    token = tokenizer.current_token;
+                } catch (const std::logic_error &) {
+                    token = engine::eof;
+                    broken = true;
+                }
+                // на неизвестном символе tokenizer еще стоит, остальные ошибки он уже прочитал
+                token_end = std::max(token_begin + broken, origin + (size_t) tokenizer.position - 1);
+            };
+
+            read(true);
+            while (true) {
+                // дальше старые элементы уровня совпадают с новыми
+                if (edit != nullptr && open.empty()) {
+                    auto shifted = [&](const Element &element) {
+                        return base + element.offset - edit->old_end + edit->new_end;
+                    };
+                    while (*resume < old->size() && (base + (*old)[*resume].offset < edit->old_end
+                                                     || shifted((*old)[*resume]) < token_begin))
+                        (*resume)++;
+                    if (token_begin >= edit->new_end && *resume < old->size()
+                        && shifted((*old)[*resume]) == token_begin)
+                        return true;
+                }
+
+                if (token == engine::eof && !broken) {
+                    if (token_begin >= end) {
+                        // у группы с ')' она не может остаться внутри новой группы
+                        if (!open.empty() && closed_level)
+                            return false;
+                        // группы без ')' тянутся до конца текста, вложенные разбираются раньше
+                        for (size_t i = open.size(); i-- > 0;) {
+                            std::vector<Element> &parent = i == 0 ? out : groups[open[i - 1].group].elements;
+                            parent[open[i].element].length = end - open[i].begin;
+                            pending.push_back(open[i].group);
+                        }
+                        if (edit != nullptr)
+                            *resume = old->size();
+                        return true;
+                    }
+                    // символ, на котором для tokenizer кончается текст: в корне после него ничего не значит
+                    if (root && open.empty()) {
+                        out.push_back({token_begin - base, 0, engine::eof});
+                        if (edit != nullptr)
+                            *resume = old->size();
+                        return true;
+                    }
+                    broken = true;
+                    token_end = token_begin + 1;
+                }
+
+                std::vector<Element> &elements = open.empty() ? out : groups[open.back().group].elements;
+                size_t level_begin = open.empty() ? base : open.back().begin;
+                Element element{token_begin - level_begin, token_end - token_begin, token};
+
+                if (broken) {
+                    // ошибку снова бросит разбор уровня, если дойдет до нее
+                    elements.push_back(element);
+                    origin = token_end;
+                    read(true);
+                    continue;
+                }
+
+                if (token == engine::opened_parentheses) {
+                    element.group = make_group(open.empty() ? level : open.back().group);
+                    groups[element.group].element = elements.size();
+                    // имя перед первой группой правки лежит в старых элементах, его ставит relex()
+                    if (!elements.empty() && elements.back().token == engine::identifier)
+                        set_function(element.group, elements.back().name);
+                    elements.push_back(element);
+                    open.push_back({element.group, token_begin, elements.size() - 1});
+                } else if (token == engine::closed_parentheses && !open.empty()) {
+                    OpenGroup closed = open.back();
+                    open.pop_back();
+                    groups[closed.group].closed = true;
+                    // группа закрывается после всех вложенных в нее
+                    pending.push_back(closed.group);
+                    std::vector<Element> &parent = open.empty() ? out : groups[open.back().group].elements;
+                    parent[closed.element].length = token_begin + 1 - closed.begin;
+                } else {
+                    // лишняя ')' остается в корне, на ней разбор и остановится
+                    if (token == engine::closed_parentheses && !root)
+                        return false;
+                    if (token == engine::number)
+                        element.number = tokenizer.number;
+                    if (token == engine::identifier)
+                        element.name = use_name(tokenizer.name);
+                    elements.push_back(element);
+                }
+
+                read(false);
+            }
+        }
+
+        /*
+         * Переносит правку в дерево групп. Правку токенизирует самая вложенная группа, внутри скобок
+         * которой она лежит; если правка меняет скобки этой группы, то группа снаружи, и так до корня
+         * */
+        void relex(size_t offset, size_t removed, size_t inserted) {
+            Edit edit{offset + removed, offset + inserted};
+
+            // спускаемся в самую вложенную группу, внутри скобок которой лежит правка
+            path.clear();
+            size_t group = 0;
+            size_t base = 0;
+            size_t end = source.size() - inserted + removed;
+            while (true) {
+                const auto &elements = groups[group].elements;
+                auto after = std::partition_point(elements.begin(), elements.end(), [&](const Element &element) {
+                    return base + element.offset < offset;
+                });
+                if (after == elements.begin())
+                    break;
+
+                const Element &candidate = *(after - 1);
+                // за символом, на котором остановился токенайзер, текст ничего не значит
+                if (candidate.token == engine::eof && candidate.length == 0)
+                    return;
+                if (candidate.token != engine::opened_parentheses)
+                    break;
+                // содержимое группы - до ')' или до конца текста
+                size_t content_end = base + candidate.offset + candidate.length - groups[candidate.group].closed;
+                if (edit.old_end > content_end)
+                    break;
+
+                path.push_back({group, base, end, (size_t) (after - 1 - elements.begin())});
+                base += candidate.offset;
+                end = content_end;
+                group = candidate.group;
+            }
+
+            size_t first;
+            size_t resume;
+            while (true) {
+                auto &elements = groups[group].elements;
+                // первый элемент, который кончается не раньше правки: он может склеиться со вставкой
+                first = (size_t) (std::partition_point(elements.begin(), elements.end(), [&](const Element &element) {
+                    return base + element.offset + element.length < offset;
+                }) - elements.begin());
+                // ')' ни с чем не склеивается
+                if (first < elements.size() && elements[first].token == engine::opened_parentheses
+                    && groups[elements[first].group].closed
+                    && base + elements[first].offset + elements[first].length == offset)
+                    first++;
+                size_t start = first < elements.size() ? std::min(offset, base + elements[first].offset) : offset;
+
+                fresh.clear();
+                resume = first;
+                size_t pending_count = pending.size();
+                if (lex(group, base, start, end - removed + inserted, fresh, &edit, &elements, &resume))
+                    break;
+
+                // скобки группы поменялись: ее целиком токенизирует родитель
+                for (const Element &element : fresh) {
+                    if (element.token == engine::opened_parentheses)
+                        free_group(element.group);
+                    else if (element.token == engine::identifier)
+                        drop_name(element.name);
+                }
+                pending.resize(pending_count);
+                group = path.back().group;
+                base = path.back().base;
+                end = path.back().end;
+                path.pop_back();
+            }
+
+            auto &elements = groups[group].elements;
+            for (size_t i = first; i < resume; i++) {
+                if (elements[i].token == engine::opened_parentheses)
+                    free_group(elements[i].group);
+                else if (elements[i].token == engine::identifier)
+                    drop_name(elements[i].name);
+            }
+            if (removed != inserted) {
+                for (size_t i = resume; i < elements.size(); i++)
+                    elements[i].offset = elements[i].offset - removed + inserted;
+            }
+            // хвост уровня сдвигается, только если число элементов поменялось
+            size_t common = std::min(fresh.size(), resume - first);
+            std::copy(fresh.begin(), fresh.begin() + (std::ptrdiff_t) common, elements.begin() + (std::ptrdiff_t) first);
+            if (common < fresh.size())
+                elements.insert(elements.begin() + (std::ptrdiff_t) resume, fresh.begin() + (std::ptrdiff_t) common, fresh.end());
+            else
+                elements.erase(elements.begin() + (std::ptrdiff_t) (first + common), elements.begin() + (std::ptrdiff_t) resume);
+
+            Group &level = groups[group];
+            size_t changed_end = first + fresh.size();
+            // номера вложенных групп в уровне: новых и сдвинутых
+            for (size_t i = first; i < (changed_end == resume ? changed_end : elements.size()); i++) {
+                if (elements[i].token == engine::opened_parentheses)
+                    groups[elements[i].group].element = i;
+            }
+            if (level.parsed) {
+                // состояния до правки продолжают разбор, после - сдвигаются и ловят, где он сошелся
+                auto &checkpoints = level.checkpoints;
+                auto by_element = [](const Checkpoint &checkpoint, size_t element) {
+                    return checkpoint.element < element;
+                };
+                auto dropped = std::lower_bound(checkpoints.begin(), checkpoints.end(), first, by_element);
+                auto after = std::lower_bound(dropped, checkpoints.end(), resume, by_element);
+                for (auto checkpoint = after; checkpoint != checkpoints.end(); checkpoint++)
+                    checkpoint->element = checkpoint->element - resume + changed_end;
+                checkpoints.erase(dropped, after);
+                // ошибка после правки останется, если разбор сойдется до нее
+                if (level.error_element != before_elements && level.error_element >= resume)
+                    level.error_element = level.error_element - resume + changed_end;
+                level.changed_begin = first;
+                level.changed_end = changed_end;
+            } else {
+                level.checkpoints.clear();
+            }
+
+            // у группы сразу за правкой могло смениться имя функции перед ней
+            for (size_t i = first; i <= changed_end && i < elements.size(); i++) {
+                if (elements[i].token != engine::opened_parentheses)
+                    continue;
+                Group &nested = groups[elements[i].group];
+                NameEntry *function = i > 0 && elements[i - 1].token == engine::identifier
+                                      ? elements[i - 1].name : nullptr;
+                if (nested.function == function)
+                    continue;
+                set_function(elements[i].group, function);
+                nested.checkpoints.clear();
+                nested.parsed = false;
+                pending.push_back(elements[i].group);
+            }
+            level.parsed = false;
+            pending.push_back(group);
+            release_unused_names();
+
+            // предки снизу вверх: группа с правкой стала длиннее, элементы за ней сдвинулись
+            for (size_t i = path.size(); i-- > 0;) {
+                const Enclosing &step = path[i];
+                auto &parent = groups[step.group].elements;
+                if (removed == inserted)
+                    break;
+                parent[step.element].length = parent[step.element].length - removed + inserted;
+                for (size_t j = step.element + 1; j < parent.size(); j++)
+                    parent[j].offset = parent[j].offset - removed + inserted;
+            }
+        }
+
+        // Разбирает группы из pending
+        void parse_pending() {
+            if (pending_unsorted) {
+                std::stable_sort(pending.begin(), pending.end(), [&](size_t left, size_t right) {
+                    return groups[left].depth > groups[right].depth;
+                });
+            }
+            // если разбор упадет, к оставшимся добавятся группы следующей правки
+            pending_unsorted = true;
+            for (size_t group : pending) {
+                if (groups[group].live && !groups[group].parsed) {
+                    try {
+                        parse_group(group);
+                    } catch (...) {
+                        // ячейки упавшего разбора никуда не попали, группа разберется целиком
+                        groups[group].checkpoints.clear();
+                        throw;
+                    }
+                }
+            }
+            pending.clear();
+            pending_unsorted = false;
+        }
+
+        // Бросает первую ошибку текста, если она есть, иначе выставляет корень
+        void finish_parse() {
+            throw_first_error();
+            root_node = groups[0].value;
+        }
+
+        /*
+         * Разбирает уровень группы: с последнего сохраненного состояния перед правкой
+         * до старого состояния после нее, с которым новое совпало, или до конца.
+         * Новое значение группы кладется на ее место в родителе. Ошибка разбора
+         * запоминается в группе вместе с элементом, на котором он остановился
+         * */
+        void parse_group(size_t index) {
+            Group &group = groups[index];
+            auto &checkpoints = group.checkpoints;
+            LevelLexer lexer{this, index};
+            LevelBuilder builder{this, &lexer};
+
+            // до правки состояния верны, после - старые, для сравнения с новыми
+            size_t kept = (size_t) (std::partition_point(checkpoints.begin(), checkpoints.end(), [&](const Checkpoint &checkpoint) {
+                return checkpoint.element < group.changed_begin;
+            }) - checkpoints.begin());
+            size_t next_old = kept;
+            auto next_stop = [&](size_t last_saved) {
+                size_t stop = last_saved + checkpoint_interval;
+                return next_old < checkpoints.size() ? std::min(stop, checkpoints[next_old].element) : stop;
+            };
+
+            saved.clear();
+            restored.clear();
+            cells.clear();
+            state.clear();
+            try {
+                size_t last_saved = 0;
+                if (kept > 0) {
+                    const Checkpoint &checkpoint = checkpoints[kept - 1];
+                    state.operators.assign(checkpoint.operators, checkpoint.operators + checkpoint.operator_count);
+                    state.operand_count = checkpoint.cell_count;
+                    state.open_parentheses = checkpoint.open_parentheses;
+                    state.expect_operand = false;
+                    cells.assign(checkpoint.cells, checkpoint.cells + checkpoint.cell_count);
+                    for (Cell *cell : cells)
+                        restored.push_back({cell, cell->holder});
+                    last_saved = checkpoint.element;
+                    lexer.stop = next_stop(last_saved);
+                    lexer.seek(last_saved);
+                } else {
+                    lexer.stop = next_stop(last_saved);
+                    lexer.start();
+                }
+
+                while (true) {
+                    state.parse_tokens(lexer, builder);
+                    if (!lexer.paused)
+                        break;
+
+                    size_t position = lexer.index;
+                    while (next_old < checkpoints.size() && checkpoints[next_old].element < position)
+                        next_old++;
+                    if (next_old < checkpoints.size() && checkpoints[next_old].element == position) {
+                        // старый разбор отсюда дошел до конца или до той же ошибки
+                        if (converged(checkpoints[next_old])) {
+                            adopt(index, next_old);
+                            splice(checkpoints, kept, next_old);
+                            group.parsed = true;
+                            return;
+                        }
+                        next_old++;
+                    }
+                    if (position >= last_saved + checkpoint_interval) {
+                        save(position);
+                        last_saved = position;
+                    }
+
+                    lexer.stop = next_stop(last_saved);
+                    lexer.seek(position);
+                }
+
+                state.finish(builder);
+                if (lexer.current_token != engine::eof)
+                    throw std::logic_error("Not understandable expression");
+            } catch (const std::logic_error &error) {
+                // дальше старым разбором считается этот: сошедшийся с ним разбор дойдет до той же ошибки
+                splice(checkpoints, kept, checkpoints.size());
+                group.error = error.what();
+                group.error_element = lexer.element();
+                group.parsed = true;
+                if (!group.listed) {
+                    group.listed = true;
+                    failed.push_back(index);
+                }
+                return;
+            }
+
+            splice(checkpoints, kept, checkpoints.size());
+            Cell *result = cells.back();
+            result->holder = &group.value;
+            group.error.clear();
+            group.parsed = true;
+            if (group.value != result->node) {
+                group.value = result->node;
+                if (group.cell != nullptr)
+                    replace(group.cell, result->node, group.parent);
+            }
+        }
+
+        // Повторяет токен элемента eof уровня level: бросает ошибку Tokenizer, если она там была
+        void check_token(size_t level, const Element &element) {
+            Tokenizer tokenizer;
+            tokenizer.set_input(std::string_view(source).substr(group_begin(level) + element.offset, element.length));
+        }
+
+        // Начало уровня в тексте: его '(' или 0 у корня
+        size_t group_begin(size_t index) const {
+            size_t begin = 0;
+            for (size_t current = index; groups[current].parent != no_group; current = groups[current].parent)
+                begin += groups[groups[current].parent].elements[groups[current].element].offset;
+            return begin;
+        }
+
+        /*
+         * Бросает ошибку, на которой остановился бы Parser: самую раннюю в тексте. На одном месте
+         * элемент внешнего уровня читается раньше вложенных, а конец вложенного - раньше внешнего
+         * */
+        void throw_first_error() {
+            const std::string *first = nullptr;
+            size_t first_position = 0;
+            size_t first_order = 0;
+            size_t count = 0;
+            for (size_t index : failed) {
+                Group &group = groups[index];
+                if (!group.live || group.error.empty()) {
+                    group.listed = false;
+                    continue;
+                }
+                failed[count++] = index;
+
+                size_t begin = group_begin(index);
+                size_t position;
+                size_t order = group.depth;
+                if (group.error_element == before_elements) {
+                    position = begin;
+                } else if (group.error_element < group.elements.size()) {
+                    position = begin + group.elements[group.error_element].offset;
+                } else {
+                    position = source.size();
+                    if (group.closed)
+                        position = begin + groups[group.parent].elements[group.element].length - 1;
+                    order = no_group - group.depth;
+                }
+                if (first == nullptr || position < first_position || (position == first_position && order < first_order)) {
+                    first = &group.error;
+                    first_position = position;
+                    first_order = order;
+                }
+            }
+            failed.resize(count);
+            if (first != nullptr)
+                throw std::logic_error(*first);
+        }
+
+        void save(size_t position) {
+            if (state.operators.size() > checkpoint_depth || cells.size() > checkpoint_depth)
+                return;
+            Checkpoint &checkpoint = saved.emplace_back();
+            checkpoint.element = position;
+            checkpoint.open_parentheses = state.open_parentheses;
+            checkpoint.operator_count = state.operators.size();
+            checkpoint.cell_count = cells.size();
+            checkpoint.operators = arena.make_array<PendingOperator>(state.operators.size());
+            checkpoint.cells = arena.make_array<Cell *>(cells.size());
+            std::copy(state.operators.begin(), state.operators.end(), checkpoint.operators);
+            std::copy(cells.begin(), cells.end(), checkpoint.cells);
+        }
+
+        // Ставит saved на место старых состояний [begin, end): хвост сдвигается, только если их число поменялось
+        void splice(std::vector<Checkpoint> &checkpoints, size_t begin, size_t end) {
+            size_t common = std::min(saved.size(), end - begin);
+            std::copy(saved.begin(), saved.begin() + (std::ptrdiff_t) common, checkpoints.begin() + (std::ptrdiff_t) begin);
+            if (common < saved.size())
+                checkpoints.insert(checkpoints.begin() + (std::ptrdiff_t) end, saved.begin() + (std::ptrdiff_t) common, saved.end());
+            else
+                checkpoints.erase(checkpoints.begin() + (std::ptrdiff_t) (begin + common), checkpoints.begin() + (std::ptrdiff_t) end);
+        }
+
+        // Новый разбор пришел в то же состояние, что старый: дальше старые ноды верны
+        bool converged(const Checkpoint &checkpoint) const {
+            return checkpoint.open_parentheses == state.open_parentheses
+                   && checkpoint.cell_count == cells.size()
+                   && std::equal(state.operators.begin(), state.operators.end(),
+                                 checkpoint.operators, checkpoint.operators + checkpoint.operator_count);
+        }
+
+        /*
+         * Кладет новые операнды со стека на места старых из состояния converged. Дальше старые ячейки
+         * представляют новые операнды, в том числе в состояниях, сохраненных этим разбором.
+         * Ячейки восстановленного стека помнят и состояния до правки, поэтому на их месте старая
+         * ячейка не остается: если новый разбор уже забрал ее в ноду, ее сменяет новая, а если
+         * восстановленная ячейка дошла до converged, старую сменяет она. Сменившая получает
+         * прежнее место старой и ее место в следующих состояниях
+         * */
+        void adopt(size_t level, size_t converged) {
+            auto &checkpoints = groups[level].checkpoints;
+            for (size_t i = 0; i < cells.size(); i++) {
+                Cell *current = cells[i];
+                Cell *old = checkpoints[converged].cells[i];
+                if (current == old)
+                    continue;
+
+                if (i < restored.size() && (restored[i].cell == old || restored[i].cell == current)) {
+                    for (size_t next = converged; next < checkpoints.size() && checkpoints[next].cell_count > i
+                                                  && checkpoints[next].cells[i] == old; next++)
+                        checkpoints[next].cells[i] = current;
+                    current->holder = restored[i].cell == old ? restored[i].holder : old->holder;
+                    replace(current, current->node, level);
+                    continue;
+                }
+
+                for (const Checkpoint &fresh_checkpoint : saved)
+                    std::replace(fresh_checkpoint.cells, fresh_checkpoint.cells + fresh_checkpoint.cell_count, current, old);
+                old->group = current->group;
+                if (current->group != no_group)
+                    groups[current->group].cell = old;
+                if (old->node != current->node)
+                    replace(old, current->node, level);
+            }
+        }
+
+        // Ставит node на место операнда cell уровня level; значение уровня так же поднимается выше
+        void replace(Cell *cell, Node *node, size_t level) {
+            while (true) {
+                cell->node = node;
+                if (cell->holder == nullptr)
+                    return;
+                *cell->holder = node;
+
+                const Group &group = groups[level];
+                if (cell->holder != &group.value || group.cell == nullptr)
+                    return;
+                cell = group.cell;
+                level = group.parent;
+            }
+        }
+    };
+}
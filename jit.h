@@ -0,0 +1,426 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "engine.h"
+#include "program.h"
+
+#if defined(__x86_64__) && defined(__unix__) && !defined(ENGINE_DISABLE_JIT)
+#define ENGINE_JIT 1
+#include <sys/mman.h>
+#endif
+
+
+namespace engine {
+    // Скомпилированная в машинный код функция: принимает значения переменных по слотам
+    using NativeFunction = double (*)(const double *variables);
+
+#ifdef ENGINE_JIT
+    namespace detail {
+        /*
+         * Генератор кода x86-64 на SSE2.
+         * Нода на глубине depth считается в регистр xmm<depth>,
+         * глубже 15-й значения уходят на машинный стек.
+         * Константы лежат в пуле после кода и читаются относительно rip
+         * */
+        class Assembler {
+        public:
+            std::vector<uint8_t> code;
+            std::vector<double> pool;
+
+            Assembler() {
+                // маска знакового бита для xorpd, должна быть выровнена на 16
+                pool.push_back(-0.0);
+                pool.push_back(-0.0);
+                // единицы для andpd после сравнения, тоже по 16
+                pool.push_back(1.0);
+                pool.push_back(1.0);
+                // +0 для sqrt(-0) + 0 = +0
+                pool.push_back(0.0);
+            }
+
+            void compile(const Node *root) {
+                compile(root, 0, 0);
+                code.push_back(0xC3); // ret
+            }
+
+            // Размер кода вместе с выровненным пулом констант
+            size_t size() const {
+                return pool_offset() + pool.size() * sizeof(double);
+            }
+
+            void write(uint8_t *memory) const {
+                std::memcpy(memory, code.data(), code.size());
+                std::memset(memory + code.size(), 0xCC, pool_offset() - code.size());
+                std::memcpy(memory + pool_offset(), pool.data(), pool.size() * sizeof(double));
+
+                for (const auto &fixup : fixups) {
+                    auto displacement = (int32_t) (pool_offset() + fixup.pool_index * sizeof(double)
+                                                   - (fixup.position + 4));
+                    std::memcpy(memory + fixup.position, &displacement, sizeof(displacement));
+                }
+            }
+
+        private:
+            static constexpr int max_register = 15;
+            // генератор рекурсивный: более глубокие деревья считает интерпретатор
+            static constexpr size_t max_nesting = 10000;
+
+            struct Fixup {
+                size_t position;
+                size_t pool_index;
+            };
+
+            std::vector<Fixup> fixups;
+
+            size_t pool_offset() const {
+                return (code.size() + 15) & ~(size_t) 15;
+            }
+
+            static constexpr size_t sign_mask = 0;
+            static constexpr size_t ones = 2;
+            static constexpr size_t zero = 4;
+
+            static bool is_comparison(Token operation) {
+                return operation >= engine::less && operation <= engine::not_equal;
+            }
+
+            /*
+             * Сравнение xmm<reg> с xmm<reg + 1>: cmpsd дает маску из единичных битов,
+             * andpd с 1.0 превращает ее в 1 или 0. Для > и >= операнды меняются местами,
+             * чтобы NaN давал 0, как в C++
+             * */
+            void comparison(Token operation, int reg) {
+                int target = reg;
+                int source = reg + 1;
+                uint8_t predicate;
+                switch (operation) {
+                    case engine::equal:
+                        predicate = 0;
+                        break;
+                    case engine::less:
+                        predicate = 1;
+                        break;
+                    case engine::less_equal:
+                        predicate = 2;
+                        break;
+                    case engine::not_equal:
+                        predicate = 4;
+                        break;
+                    case engine::greater:
+                        predicate = 1;
+                        std::swap(target, source);
+                        break;
+                    default:
+                        predicate = 2;
+                        std::swap(target, source);
+                        break;
+                }
+
+                register_operation(0xF2, 0xC2, target, source); // cmpsd
+                code.push_back(predicate);
+                if (target != reg)
+                    register_operation(0x66, 0x28, reg, target); // movapd
+                pool_operation(0x66, 0x54, reg, ones);           // andpd
+            }
+
+            /*
+             * Степень с постоянным показателем, основание уже в xmm<reg>.
+             * Порядок умножений тот же, что в engine::Program, результаты совпадают
+             * */
+            void reduced_power(PowerReduction reduction, unsigned exponent, int reg) {
+                switch (reduction) {
+                    case engine::square_power:
+                        register_operation(0xF2, 0x59, reg, reg); // mulsd
+                        return;
+                    case engine::sqrt_power:
+                        register_operation(0xF2, 0x51, reg, reg); // sqrtsd
+                        pool_operation(0xF2, 0x58, reg, zero);    // addsd +0
+                        return;
+                    default:
+                        break;
+                }
+
+                // дальше нужны свободные регистры, на стек ради этого не уходим
+                if (reg + 2 > max_register)
+                    throw std::logic_error("Not enough registers for power");
+
+                if (reduction == engine::cube_power) {
+                    register_operation(0x66, 0x28, reg + 1, reg); // movapd
+                    register_operation(0xF2, 0x59, reg, reg);     // mulsd
+                    register_operation(0xF2, 0x59, reg, reg + 1); // mulsd
+                    return;
+                }
+
+                // двоичное разложение показателя, развернутое во время компиляции
+                int base = reg;
+                int result = reg + 1;
+                pool_operation(0xF2, 0x10, result, ones); // movsd 1.0
+                unsigned rest = exponent;
+                while (rest != 0) {
+                    if (rest & 1)
+                        register_operation(0xF2, 0x59, result, base); // mulsd
+                    rest >>= 1;
+                    if (rest != 0)
+                        register_operation(0xF2, 0x59, base, base);
+                }
+                register_operation(0x66, 0x28, reg, result); // movapd
+            }
+
+            // floor(xmm<reg> / xmm<reg + 1>): roundsd есть только начиная с SSE4.1
+            void floor_division(int reg) {
+                if (!has_sse41())
+                    throw std::logic_error("Floor division needs SSE4.1");
+                register_operation(0xF2, 0x5E, reg, reg + 1); // divsd
+                // roundsd xmm<reg>, xmm<reg>, 9: округление вниз без исключения неточности
+                code.push_back(0x66);
+                if (reg & 8)
+                    code.push_back(0x45);
+                code.insert(code.end(), {0x0F, 0x3A, 0x0B});
+                code.push_back(0xC0 | ((reg & 7) << 3) | (reg & 7));
+                code.push_back(0x09);
+            }
+
+            static bool has_sse41() {
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("sse4.1");
+            }
+
+            static uint8_t operation_code(Token operation) {
+                switch (operation) {
+                    case engine::addition:
+                        return 0x58;
+                    case engine::subtraction:
+                        return 0x5C;
+                    case engine::multiplication:
+                        return 0x59;
+                    case engine::division:
+                        return 0x5E;
+                    default:
+                        throw std::logic_error("Operation is not supported by jit");
+                }
+            }
+
+            // prefix [REX] 0F opcode - общий вид SSE2 инструкций
+            void sse(uint8_t prefix, uint8_t opcode, int reg, int base) {
+                code.push_back(prefix);
+                uint8_t rex = 0x40 | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+                if (rex != 0x40)
+                    code.push_back(rex);
+                code.push_back(0x0F);
+                code.push_back(opcode);
+            }
+
+            void displacement(int32_t value) {
+                uint8_t bytes[4];
+                std::memcpy(bytes, &value, sizeof(value));
+                code.insert(code.end(), bytes, bytes + 4);
+            }
+
+            // op xmm<reg>, xmm<source>
+            void register_operation(uint8_t prefix, uint8_t opcode, int reg, int source) {
+                sse(prefix, opcode, reg, source);
+                code.push_back(0xC0 | ((reg & 7) << 3) | (source & 7));
+            }
+
+            // op xmm<reg>, [rip + константа из пула]
+            void pool_operation(uint8_t prefix, uint8_t opcode, int reg, size_t pool_index) {
+                sse(prefix, opcode, reg, 0);
+                code.push_back(0x05 | ((reg & 7) << 3));
+                fixups.push_back({code.size(), pool_index});
+                displacement(0);
+            }
+
+            // op xmm<reg>, [rsp]
+            void stack_operation(uint8_t prefix, uint8_t opcode, int reg) {
+                sse(prefix, opcode, reg, 0);
+                code.push_back(0x04 | ((reg & 7) << 3));
+                code.push_back(0x24);
+            }
+
+            void compile(const Node *node, int depth, size_t nesting) {
+                int reg = depth < max_register ? depth : max_register;
+                if (++nesting > max_nesting)
+                    throw std::logic_error("Expression is too deep for jit");
+
+                switch (node->type) {
+                    case engine::number_node: {
+                        pool.push_back(static_cast<const NumberNode *>(node)->number);
+                        pool_operation(0xF2, 0x10, reg, pool.size() - 1); // movsd
+                        return;
+                    }
+                    case engine::variable_node: {
+                        auto slot = static_cast<const VariableNode *>(node)->slot;
+                        if (slot > INT32_MAX / sizeof(double))
+                            throw std::logic_error("Too many variables for jit");
+                        // movsd xmm<reg>, [rdi + 8 * slot]
+                        sse(0xF2, 0x10, reg, 0);
+                        code.push_back(0x87 | ((reg & 7) << 3));
+                        displacement((int32_t) (slot * sizeof(double)));
+                        return;
+                    }
+                    case engine::call_node:
+                        // вызов испортил бы регистры xmm, в которых лежат промежуточные значения
+                        throw std::logic_error("Function calls are not supported by jit");
+                    case engine::unary_operation_node: {
+                        auto unary = static_cast<const UnaryOperationNode *>(node);
+                        compile(unary->right_leaf, depth, nesting);
+                        if (unary->operation == engine::subtraction)
+                            pool_operation(0x66, 0x57, reg, sign_mask); // xorpd
+                        return;
+                    }
+                    case engine::binary_operation_node: {
+                        auto binary = static_cast<const BinaryOperationNode *>(node);
+
+                        if (binary->operation == engine::power && binary->right_leaf->type == engine::number_node) {
+                            double exponent = static_cast<const NumberNode *>(binary->right_leaf)->number;
+                            PowerReduction reduction = reduce_power(exponent);
+                            if (reduction != engine::no_reduction) {
+                                compile(binary->left_leaf, depth, nesting);
+                                reduced_power(reduction, (unsigned) exponent, reg);
+                                return;
+                            }
+                        }
+
+                        if (reg + 1 <= max_register) {
+                            compile(binary->left_leaf, depth, nesting);
+                            compile(binary->right_leaf, depth + 1, nesting);
+                            if (is_comparison(binary->operation))
+                                comparison(binary->operation, reg);
+                            else if (binary->operation == engine::integer_division)
+                                floor_division(reg);
+                            else
+                                register_operation(0xF2, operation_code(binary->operation), reg, reg + 1);
+                            return;
+                        }
+
+                        uint8_t opcode = operation_code(binary->operation);
+
+                        // регистры кончились: правое значение живет на стеке
+                        compile(binary->right_leaf, depth, nesting);
+                        code.insert(code.end(), {0x48, 0x83, 0xEC, 0x08}); // sub rsp, 8
+                        stack_operation(0xF2, 0x11, reg);                   // movsd [rsp], xmm<reg>
+                        compile(binary->left_leaf, depth, nesting);
+                        stack_operation(0xF2, opcode, reg);                 // op xmm<reg>, [rsp]
+                        code.insert(code.end(), {0x48, 0x83, 0xC4, 0x08}); // add rsp, 8
+                        return;
+                    }
+                }
+            }
+        };
+    }
+#endif
+
+    /*
+     * Выражение, скомпилированное в машинный код x86-64.
+     * Если JIT выключен (ENGINE_DISABLE_JIT), недоступен на платформе
+     * или не поддерживает какую-то ноду, eval() считает через engine::Program
+     * */
+    class JitFunction {
+    public:
+        explicit JitFunction(const Node *root, size_t variable_count = 0) {
+            this->variable_count = variable_count;
+#ifdef ENGINE_JIT
+            try {
+                compile(root);
+            } catch (const std::logic_error &) {
+                function = nullptr;
+            }
+#endif
+            if (function == nullptr)
+                program = Program(root, variable_count);
+        }
+
+        explicit JitFunction(const Expression &expression)
+                : JitFunction(expression.root, expression.variable_count) {}
+
+        JitFunction(const JitFunction &) = delete;
+        JitFunction &operator=(const JitFunction &) = delete;
+
+        JitFunction(JitFunction &&other) noexcept {
+            *this = std::move(other);
+        }
+
+        JitFunction &operator=(JitFunction &&other) noexcept {
+            if (this != &other) {
+                release();
+                function = std::exchange(other.function, nullptr);
+                page = std::exchange(other.page, nullptr);
+                page_size = std::exchange(other.page_size, 0);
+                program = std::move(other.program);
+                variable_count = other.variable_count;
+            }
+            return *this;
+        }
+
+        ~JitFunction() {
+            release();
+        }
+
+        // Указатель на машинный код или nullptr, если работает интерпретатор
+        NativeFunction native() const {
+            return function;
+        }
+
+        bool is_native() const {
+            return function != nullptr;
+        }
+
+        double eval(const double *variables = nullptr) const {
+            if (function != nullptr)
+                return function(variables);
+            return program.eval(variables);
+        }
+
+        double eval(const std::vector<double> &variables) const {
+            if (variables.size() < variable_count)
+                throw std::logic_error("Not enough variable values");
+            return eval(variables.data());
+        }
+
+    private:
+        NativeFunction function = nullptr;
+        void *page = nullptr;
+        size_t page_size = 0;
+        Program program;
+        size_t variable_count = 0;
+
+#ifdef ENGINE_JIT
+        void compile(const Node *root) {
+            detail::Assembler assembler;
+            assembler.compile(root);
+
+            size_t size = assembler.size();
+            void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED)
+                return;
+
+            assembler.write(static_cast<uint8_t *>(memory));
+
+            // страница никогда не бывает одновременно записываемой и исполняемой
+            if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+                munmap(memory, size);
+                return;
+            }
+
+            page = memory;
+            page_size = size;
+            function = reinterpret_cast<NativeFunction>(memory);
+        }
+#endif
+
+        void release() {
+#ifdef ENGINE_JIT
+            if (page != nullptr)
+                munmap(page, page_size);
+#endif
+            page = nullptr;
+            page_size = 0;
+            function = nullptr;
+        }
+    };
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace engine {
+    /*
+     * Файл, отображенный в память только для чтения.
+     * Ядро подсказывается, что читать будем последовательно,
+     * поэтому страницы подгружаются заранее и быстро вытесняются
+     * */
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::string &path) {
+            int descriptor = open(path.c_str(), O_RDONLY);
+            if (descriptor < 0)
+                throw std::runtime_error("Can not open " + path);
+
+            struct stat status{};
+            if (fstat(descriptor, &status) != 0 || !S_ISREG(status.st_mode)) {
+                close(descriptor);
+                throw std::runtime_error("Can not map " + path);
+            }
+
+            size = (size_t) status.st_size;
+            // пустой файл отобразить нельзя, но и читать в нем нечего
+            if (size > 0) {
+                void *memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+                if (memory == MAP_FAILED) {
+                    close(descriptor);
+                    throw std::runtime_error("Can not map " + path);
+                }
+                madvise(memory, size, MADV_SEQUENTIAL);
+                data = static_cast<const char *>(memory);
+            }
+            close(descriptor);
+        }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        MappedFile(MappedFile &&other) noexcept {
+            data = std::exchange(other.data, nullptr);
+            size = std::exchange(other.size, 0);
+        }
+
+        ~MappedFile() {
+            if (data != nullptr)
+                munmap(const_cast<char *>(data), size);
+        }
+
+        std::string_view text() const {
+            return std::string_view(data, size);
+        }
+
+    private:
+        const char *data = nullptr;
+        size_t size = 0;
+    };
+}
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+#include "engine.h"
+
+
+namespace engine {
+    // Сколько нод было в выражении до оптимизации и сколько осталось
+    struct OptimizationReport {
+        size_t nodes_before = 0;
+        size_t nodes_after = 0;
+    };
+
+    inline size_t count_nodes(const Node *root) {
+        // обход без рекурсии, деревья бывают очень глубокими
+        std::vector<const Node *> pending = {root};
+        size_t count = 0;
+        while (!pending.empty()) {
+            const Node *node = pending.back();
+            pending.pop_back();
+            count++;
+
+            if (node->type == engine::unary_operation_node) {
+                pending.push_back(static_cast<const UnaryOperationNode *>(node)->right_leaf);
+            } else if (node->type == engine::binary_operation_node) {
+                auto binary = static_cast<const BinaryOperationNode *>(node);
+                pending.push_back(binary->left_leaf);
+                pending.push_back(binary->right_leaf);
+            } else if (node->type == engine::call_node) {
+                auto call = static_cast<const CallNode *>(node);
+                pending.insert(pending.end(), call->arguments, call->arguments + call->argument_count);
+            }
+        }
+        return count;
+    }
+
+    /*
+     * Свертка констант и алгебраические упрощения.
+     * Новые ноды создаются в арене выражения, старые остаются там до ее освобождения.
+     * Упрощения точные для IEEE 754, результат совпадает с исходным деревом до бита:
+     * x*0 не упрощается (для бесконечности и NaN это не ноль), x+0 и 0-x тоже (знак нуля).
+     * Функции считаются чистыми: вызов с постоянными аргументами сворачивается.
+     * shared - в дереве есть общие ноды: каждая оптимизируется один раз и остается общей
+     * */
+    class Optimizer {
+    public:
+        explicit Optimizer(Arena *arena, bool shared = false) {
+            this->arena = arena;
+            this->shared = shared;
+        }
+
+        /*
+         * Обход без рекурсии, как у Evaluator: на стеке frames ноды, у которых
+         * оптимизированы первые done операндов, а сами результаты лежат на стеке results
+         * */
+        Node *optimize(Node *root) {
+            frames.clear();
+            results.clear();
+            frames.push_back({root, 0});
+
+            while (!frames.empty()) {
+                auto &frame = frames.back();
+                Node *node = frame.node;
+
+                if (frame.done == 0 && shared) {
+                    auto found = optimized.find(node);
+                    if (found != optimized.end()) {
+                        results.push_back(found->second);
+                        frames.pop_back();
+                        continue;
+                    }
+                }
+
+                size_t count = operand_count(node);
+                if (frame.done < count) {
+                    // frame становится недействительной после push_back
+                    Node *next = operand(node, frame.done++);
+                    frames.push_back({next, 0});
+                    continue;
+                }
+
+                Node *result = optimize_node(node, results.data() + results.size() - count);
+                results.resize(results.size() - count);
+                results.push_back(result);
+                if (shared)
+                    optimized.emplace(node, result);
+                frames.pop_back();
+            }
+            return results.back();
+        }
+
+    private:
+        struct Frame {
+            Node *node;
+            size_t done;
+        };
+
+        Arena *arena;
+        bool shared;
+        // результаты для уже оптимизированных общих нод
+        std::unordered_map<const Node *, Node *> optimized;
+        std::vector<Frame> frames;
+        std::vector<Node *> results;
+
+        // operands - уже оптимизированные операнды ноды по порядку
+        Node *optimize_node(Node *node, Node **operands) {
+            switch (node->type) {
+                case engine::unary_operation_node:
+                    return optimize_unary(static_cast<UnaryOperationNode *>(node), operands[0]);
+                case engine::binary_operation_node:
+                    return optimize_binary(static_cast<BinaryOperationNode *>(node), operands[0], operands[1]);
+                case engine::call_node:
+                    return optimize_call(static_cast<CallNode *>(node), operands);
+                default:
+                    return node;
+            }
+        }
+
+        static bool is_number(const Node *node, double value) {
+            return node->type == engine::number_node && static_cast<const NumberNode *>(node)->number == value;
+        }
+
+        static bool is_negative_zero(const Node *node) {
+            return is_number(node, 0) && std::signbit(static_cast<const NumberNode *>(node)->number);
+        }
+
+        static bool is_negation(const Node *node) {
+            return node->type == engine::unary_operation_node
+                   && static_cast<const UnaryOperationNode *>(node)->operation == engine::subtraction;
+        }
+
+        Node *negate(Node *node) {
+            // --x = x
+            if (is_negation(node))
+                return static_cast<UnaryOperationNode *>(node)->right_leaf;
+            if (node->type == engine::number_node)
+                return arena->make<NumberNode>(-static_cast<NumberNode *>(node)->number);
+            return arena->make<UnaryOperationNode>(node, engine::subtraction);
+        }
+
+        Node *optimize_unary(UnaryOperationNode *unary, Node *right) {
+            if (unary->operation == engine::addition)
+                return right;
+            return negate(right);
+        }
+
+        Node *optimize_binary(BinaryOperationNode *binary, Node *left, Node *right) {
+            Token operation = binary->operation;
+
+            if (left->type == engine::number_node && right->type == engine::number_node) {
+                double value = apply_binary(operation, static_cast<NumberNode *>(left)->number,
+                                            static_cast<NumberNode *>(right)->number);
+                return arena->make<NumberNode>(value);
+            }
+
+            switch (operation) {
+                case engine::addition:
+                    // x + 0 и 0 + x не упрощаются: -0 + 0 = +0. А x + (-0) = x для любого x
+                    if (is_negative_zero(right))
+                        return left;
+                    // x + -y = x - y
+                    if (is_negation(right))
+                        return arena->make<BinaryOperationNode>(
+                                left, static_cast<UnaryOperationNode *>(right)->right_leaf, engine::subtraction);
+                    break;
+                case engine::subtraction:
+                    // x - 0 = x и для -0; 0 - x не упрощается: 0 - 0 = +0, а -0 = -0
+                    if (is_number(right, 0) && !is_negative_zero(right))
+                        return left;
+                    // x - -y = x + y
+                    if (is_negation(right))
+                        return arena->make<BinaryOperationNode>(
+                                left, static_cast<UnaryOperationNode *>(right)->right_leaf, engine::addition);
+                    break;
+                case engine::multiplication:
+                    if (is_number(right, 1))
+                        return left;
+                    if (is_number(left, 1))
+                        return right;
+                    if (is_number(right, -1))
+                        return negate(left);
+                    if (is_number(left, -1))
+                        return negate(right);
+                    break;
+                case engine::division:
+                    if (is_number(right, 1))
+                        return left;
+                    if (is_number(right, -1))
+                        return negate(left);
+                    break;
+                case engine::power:
+                    if (is_number(right, 1))
+                        return left;
+                    // pow(x, 0) = 1 даже для NaN и бесконечности
+                    if (is_number(right, 0))
+                        return arena->make<NumberNode>(1.0);
+                    break;
+                default:
+                    break;
+            }
+
+            if (left == binary->left_leaf && right == binary->right_leaf)
+                return binary;
+            return arena->make<BinaryOperationNode>(left, right, operation);
+        }
+
+        Node *optimize_call(CallNode *call, Node **arguments) {
+            bool constant = true;
+            bool changed = false;
+            for (size_t i = 0; i < call->argument_count; i++) {
+                constant = constant && arguments[i]->type == engine::number_node;
+                changed = changed || arguments[i] != call->arguments[i];
+            }
+
+            if (constant) {
+                double values[max_arguments];
+                for (size_t i = 0; i < call->argument_count; i++)
+                    values[i] = static_cast<NumberNode *>(arguments[i])->number;
+                return arena->make<NumberNode>(call->function->call(values));
+            }
+
+            if (!changed)
+                return call;
+            Node **copy = arena->make_array<Node *>(call->argument_count);
+            std::copy(arguments, arguments + call->argument_count, copy);
+            return arena->make<CallNode>(call->function, copy);
+        }
+    };
+
+    // Оптимизирует выражение на месте и сообщает, сколько нод осталось
+    inline OptimizationReport optimize(Expression &expression) {
+        OptimizationReport report;
+        report.nodes_before = count_nodes(expression.root);
+
+        Optimizer optimizer(&expression.arena, expression.shared);
+        expression.root = optimizer.optimize(expression.root);
+
+        report.nodes_after = count_nodes(expression.root);
+        return report;
+    }
+
+    /*
+     * Склеивает одинаковые подвыражения: в (a+b)*(a+b)/(a+b) остается одна нода a+b.
+     * Дерево становится DAG, и Program считает каждую общую ноду один раз за eval().
+     * nodes_after - число разных нод. Звать после optimize(): оптимизатор пересобирает
+     * измененные ветки, и общие ноды снова размножаются
+     * */
+    inline OptimizationReport share_subexpressions(Expression &expression) {
+        OptimizationReport report;
+        report.nodes_before = count_nodes(expression.root);
+
+        NodeInterner interner(&expression.arena);
+        expression.root = interner.intern(expression.root);
+        expression.shared = true;
+
+        report.nodes_after = interner.size();
+        return report;
+    }
+}
@@ -0,0 +1,406 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "engine.h"
+
+
+namespace engine {
+    // Инструкции стековой машины
+    enum OpCode : uint8_t {
+        push_constant,
+        push_variable,
+        add,
+        sub,
+        mul,
+        div,
+        neg,
+        // сравнения кладут на стек 1 или 0
+        lt,
+        le,
+        gt,
+        ge,
+        eq,
+        ne,
+        pow,
+        mod,
+        idiv,
+        // степени с постоянным показателем, правый операнд на стек не кладется
+        square,
+        cube,
+        sqrt,
+        ipow,
+        // аргументы - вершина стека, результат кладется вместо них
+        call,
+        // общая нода: store копирует вершину во временную ячейку, load кладет ячейку на стек
+        store,
+        load,
+    };
+
+    struct Instruction {
+        OpCode code;
+        // индекс константы для push_constant, слот для push_variable, показатель для ipow,
+        // индекс функции для call, временная ячейка для store и load
+        uint32_t operand;
+    };
+
+    /*
+     * Выражение, скомпилированное в линейный байткод.
+     * Дерево обходится один раз при компиляции,
+     * дальше eval() крутит плотный цикл без указателей на ноды.
+     * Один раз скомпилированную программу можно считать
+     * с разными значениями переменных без повторного разбора
+     * */
+    class Program {
+    public:
+        std::vector<Instruction> code;
+        std::vector<double> constants;
+        std::vector<const Function *> functions;
+        // сколько значений одновременно лежит на стеке
+        size_t stack_size = 0;
+        // ячейки для значений общих нод, лежат в памяти за стеком
+        size_t temporary_count = 0;
+        // сколько значений переменных ожидает eval()
+        size_t variable_count = 0;
+
+        Program() = default;
+
+        /*
+         * shared - в дереве есть общие ноды (см. share_subexpressions): каждая считается один раз
+         * и дальше берется из временной ячейки. Без него DAG компилируется как дерево
+         * */
+        explicit Program(const Node *root, size_t variable_count = 0, bool shared = false) {
+            this->variable_count = variable_count;
+            compile(root, shared);
+        }
+
+        explicit Program(const Expression &expression)
+                : Program(expression.root, expression.variable_count, expression.shared) {}
+
+        double eval(const std::vector<double> &variables) const {
+            if (variables.size() < variable_count)
+                throw std::logic_error("Not enough variable values");
+            return eval(variables.data());
+        }
+
+        double eval(const double *variables = nullptr) const {
+            double small_stack[64];
+            std::vector<double> large_stack;
+            double *stack = small_stack;
+            if (stack_size + temporary_count > 64) {
+                large_stack.resize(stack_size + temporary_count);
+                stack = large_stack.data();
+            }
+            double *temporaries = stack + stack_size;
+
+            // вершина стека живет в регистре, в памяти лежит только остальное
+            double top = 0;
+            double *rest = stack;
+            const double *constant = constants.data();
+
+            for (const auto &instruction : code) {
+                switch (instruction.code) {
+                    case engine::push_constant:
+                        *rest++ = top;
+                        top = constant[instruction.operand];
+                        break;
+                    case engine::push_variable:
+                        *rest++ = top;
+                        top = variables[instruction.operand];
+                        break;
+                    case engine::add:
+                        top = *--rest + top;
+                        break;
+                    case engine::sub:
+                        top = *--rest - top;
+                        break;
+                    case engine::mul:
+                        top = *--rest * top;
+                        break;
+                    case engine::div:
+                        top = *--rest / top;
+                        break;
+                    case engine::neg:
+                        top = -top;
+                        break;
+                    case engine::lt:
+                        top = *--rest < top;
+                        break;
+                    case engine::le:
+                        top = *--rest <= top;
+                        break;
+                    case engine::gt:
+                        top = *--rest > top;
+                        break;
+                    case engine::ge:
+                        top = *--rest >= top;
+                        break;
+                    case engine::eq:
+                        top = *--rest == top;
+                        break;
+                    case engine::ne:
+                        top = *--rest != top;
+                        break;
+                    case engine::pow:
+                        top = exponentiate(*--rest, top);
+                        break;
+                    case engine::mod:
+                        top = std::fmod(*--rest, top);
+                        break;
+                    case engine::idiv:
+                        top = std::floor(*--rest / top);
+                        break;
+                    case engine::square:
+                        top = top * top;
+                        break;
+                    case engine::cube:
+                        top = top * top * top;
+                        break;
+                    case engine::sqrt:
+                        top = engine::half_power(top);
+                        break;
+                    case engine::ipow:
+                        top = engine::powi(top, instruction.operand);
+                        break;
+                    case engine::call: {
+                        // вершина дописывается в память, и аргументы лежат подряд
+                        const Function *function = functions[instruction.operand];
+                        *rest = top;
+                        rest = rest + 1 - function->arity;
+                        top = function->call(rest);
+                        break;
+                    }
+                    case engine::store:
+                        temporaries[instruction.operand] = top;
+                        break;
+                    case engine::load:
+                        *rest++ = top;
+                        top = temporaries[instruction.operand];
+                        break;
+                }
+            }
+            return top;
+        }
+
+    private:
+        void emit(OpCode code, uint32_t operand = 0) {
+            this->code.push_back({code, operand});
+        }
+
+        /*
+         * Обход в обратном порядке без рекурсии, как в engine::Evaluator:
+         * глубина дерева ограничена только памятью
+         * */
+        void compile(const Node *root, bool shared) {
+            struct Frame {
+                const Node *node;
+                // сколько операндов уже скомпилировано
+                size_t done;
+            };
+            std::vector<Frame> frames;
+            // сколько значений уже лежит на стеке машины
+            size_t depth = 0;
+
+            // ссылки на ноды с несколькими родителями и ячейки уже посчитанных общих нод
+            std::unordered_map<const Node *, size_t> uses;
+            std::unordered_map<const Node *, uint32_t> temporaries;
+            if (shared)
+                uses = count_uses(root);
+
+            const Node *node = root;
+            while (true) {
+                // общая нода, которая уже посчитана, берется из ячейки, как лист
+                bool loaded = load_shared(node, temporaries);
+                while (!loaded) {
+                    const Node *operand = first_operand(node);
+                    if (operand == nullptr)
+                        break;
+                    frames.push_back({node, 0});
+                    node = operand;
+                    loaded = load_shared(node, temporaries);
+                }
+
+                if (!loaded) {
+                    compile_leaf(node);
+                    store_shared(node, uses, temporaries);
+                }
+                if (depth + 1 > stack_size)
+                    stack_size = depth + 1;
+
+                while (true) {
+                    if (frames.empty())
+                        return;
+
+                    auto &frame = frames.back();
+                    if (frame.node->type == engine::unary_operation_node) {
+                        if (static_cast<const UnaryOperationNode *>(frame.node)->operation == engine::subtraction)
+                            emit(engine::neg);
+                        store_shared(frame.node, uses, temporaries);
+                        frames.pop_back();
+                        continue;
+                    }
+
+                    if (frame.node->type == engine::call_node) {
+                        auto call = static_cast<const CallNode *>(frame.node);
+                        if (++frame.done < call->argument_count) {
+                            depth++;
+                            node = call->arguments[frame.done];
+                            break;
+                        }
+
+                        // перед вызовом последний аргумент тоже уходит в память
+                        if (depth + 2 > stack_size)
+                            stack_size = depth + 2;
+                        emit_call(call->function);
+                        depth -= call->argument_count - 1;
+                        store_shared(call, uses, temporaries);
+                        frames.pop_back();
+                        continue;
+                    }
+
+                    auto binary = static_cast<const BinaryOperationNode *>(frame.node);
+                    if (frame.done == 0 && binary->operation == engine::power && compile_power(binary->right_leaf)) {
+                        store_shared(binary, uses, temporaries);
+                        frames.pop_back();
+                        continue;
+                    }
+                    if (frame.done == 0) {
+                        frame.done = 1;
+                        depth++;
+                        node = binary->right_leaf;
+                        break;
+                    }
+
+                    emit(opcode(binary->operation));
+                    depth--;
+                    store_shared(binary, uses, temporaries);
+                    frames.pop_back();
+                }
+            }
+        }
+
+        // Сколько родителей у каждой ноды; каждая нода DAG обходится один раз
+        static std::unordered_map<const Node *, size_t> count_uses(const Node *root) {
+            std::unordered_map<const Node *, size_t> uses;
+            std::vector<const Node *> pending = {root};
+            while (!pending.empty()) {
+                const Node *node = pending.back();
+                pending.pop_back();
+                for (size_t i = 0; i < operand_count(node); i++) {
+                    const Node *child = operand(node, i);
+                    if (++uses[child] == 1)
+                        pending.push_back(child);
+                }
+            }
+            return uses;
+        }
+
+        // После вычисления общая нода сохраняется для следующих ссылок. Числа и переменные дешевле загрузить заново
+        void store_shared(const Node *node, const std::unordered_map<const Node *, size_t> &uses,
+                          std::unordered_map<const Node *, uint32_t> &temporaries) {
+            if (uses.empty() || node->type == engine::number_node || node->type == engine::variable_node)
+                return;
+            auto found = uses.find(node);
+            if (found == uses.end() || found->second < 2)
+                return;
+
+            temporaries.emplace(node, (uint32_t) temporary_count);
+            emit(engine::store, (uint32_t) temporary_count++);
+        }
+
+        bool load_shared(const Node *node, const std::unordered_map<const Node *, uint32_t> &temporaries) {
+            if (temporaries.empty())
+                return false;
+            auto found = temporaries.find(node);
+            if (found == temporaries.end())
+                return false;
+
+            emit(engine::load, found->second);
+            return true;
+        }
+
+        void emit_call(const Function *function) {
+            functions.push_back(function);
+            emit(engine::call, (uint32_t) (functions.size() - 1));
+        }
+
+        void compile_leaf(const Node *node) {
+            if (node->type == engine::number_node) {
+                constants.push_back(static_cast<const NumberNode *>(node)->number);
+                emit(engine::push_constant, (uint32_t) (constants.size() - 1));
+                return;
+            }
+
+            // функция без аргументов кладет результат, как константа
+            if (node->type == engine::call_node) {
+                emit_call(static_cast<const CallNode *>(node)->function);
+                return;
+            }
+
+            auto variable = static_cast<const VariableNode *>(node);
+            if (variable->slot >= variable_count)
+                variable_count = variable->slot + 1;
+            emit(engine::push_variable, (uint32_t) variable->slot);
+        }
+
+        // x^2, x^3, x^0.5 и небольшие целые степени без вызова pow
+        bool compile_power(const Node *exponent) {
+            if (exponent->type != engine::number_node)
+                return false;
+            double value = static_cast<const NumberNode *>(exponent)->number;
+            switch (reduce_power(value)) {
+                case engine::square_power:
+                    emit(engine::square);
+                    return true;
+                case engine::cube_power:
+                    emit(engine::cube);
+                    return true;
+                case engine::sqrt_power:
+                    emit(engine::sqrt);
+                    return true;
+                case engine::integer_power:
+                    emit(engine::ipow, (uint32_t) value);
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        static OpCode opcode(Token operation) {
+            switch (operation) {
+                case engine::addition:
+                    return engine::add;
+                case engine::subtraction:
+                    return engine::sub;
+                case engine::multiplication:
+                    return engine::mul;
+                case engine::division:
+                    return engine::div;
+                case engine::less:
+                    return engine::lt;
+                case engine::less_equal:
+                    return engine::le;
+                case engine::greater:
+                    return engine::gt;
+                case engine::greater_equal:
+                    return engine::ge;
+                case engine::equal:
+                    return engine::eq;
+                case engine::not_equal:
+                    return engine::ne;
+                case engine::power:
+                    return engine::pow;
+                case engine::modulo:
+                    return engine::mod;
+                case engine::integer_division:
+                    return engine::idiv;
+                default:
+                    throw std::logic_error("Operation is not supported by program");
+            }
+        }
+    };
+}
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "vector_math.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define ENGINE_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+
+/*
+ * Ядра пакетного вычисления: операция над блоком значений.
+ * Для x86-64 есть версии на SSE2, AVX2 и AVX-512,
+ * нужная выбирается во время работы по CPUID
+ * */
+namespace engine::simd {
+    // Наборы инструкций в порядке возрастания ширины вектора
+    enum Isa {
+        scalar,
+        sse2,
+        avx2,
+        avx512,
+    };
+
+    using BinaryKernel = void (*)(const double *left, const double *right, double *out, size_t n);
+    using UnaryKernel = void (*)(const double *in, double *out, size_t n);
+
+    struct Kernels {
+        Isa isa;
+        BinaryKernel add;
+        BinaryKernel sub;
+        BinaryKernel mul;
+        BinaryKernel div;
+        UnaryKernel neg;
+        // встроенные функции, см. engine::math
+        UnaryKernel sqrt;
+        UnaryKernel abs;
+        UnaryKernel floor;
+        UnaryKernel ceil;
+        UnaryKernel exp;
+        UnaryKernel log;
+        UnaryKernel sin;
+        UnaryKernel cos;
+        BinaryKernel min;
+        BinaryKernel max;
+    };
+
+    inline const char *isa_name(Isa isa) {
+        switch (isa) {
+            case scalar:
+                return "scalar";
+            case sse2:
+                return "sse2";
+            case avx2:
+                return "avx2";
+            case avx512:
+                return "avx512";
+        }
+        return "unknown";
+    }
+
+    namespace detail {
+#define ENGINE_SCALAR_BINARY(name, op)                                                    \
+        inline void name(const double *left, const double *right, double *out, size_t n) { \
+            for (size_t i = 0; i < n; i++)                                                 \
+                out[i] = left[i] op right[i];                                              \
+        }
+
+        ENGINE_SCALAR_BINARY(scalar_add, +)
+        ENGINE_SCALAR_BINARY(scalar_sub, -)
+        ENGINE_SCALAR_BINARY(scalar_mul, *)
+        ENGINE_SCALAR_BINARY(scalar_div, /)
+
+        inline void scalar_neg(const double *in, double *out, size_t n) {
+            for (size_t i = 0; i < n; i++)
+                out[i] = -in[i];
+        }
+
+#undef ENGINE_SCALAR_BINARY
+
+        // Цикл по функции одного аргумента, in и out могут совпадать
+#define ENGINE_UNARY_LOOP(name, attributes, function)                    \
+        attributes inline void name(const double *in, double *out, size_t n) { \
+            for (size_t i = 0; i < n; i++)                                 \
+                out[i] = function(in[i]);                                  \
+        }
+
+#define ENGINE_BINARY_LOOP(name, attributes, function)                                           \
+        attributes inline void name(const double *left, const double *right, double *out, size_t n) { \
+            for (size_t i = 0; i < n; i++)                                                         \
+                out[i] = function(left[i], right[i]);                                              \
+        }
+
+        /*
+         * Без широких векторов функции считает libm: по одному значению она быстрее
+         * полиномов из engine::math, которые окупаются только в векторном цикле
+         * */
+        ENGINE_UNARY_LOOP(scalar_sqrt, , std::sqrt)
+        ENGINE_UNARY_LOOP(scalar_abs, , std::fabs)
+        ENGINE_UNARY_LOOP(scalar_floor, , std::floor)
+        ENGINE_UNARY_LOOP(scalar_ceil, , std::ceil)
+        ENGINE_UNARY_LOOP(scalar_exp, , std::exp)
+        ENGINE_UNARY_LOOP(scalar_log, , std::log)
+        ENGINE_UNARY_LOOP(scalar_sin, , std::sin)
+        ENGINE_UNARY_LOOP(scalar_cos, , std::cos)
+        ENGINE_BINARY_LOOP(scalar_min, , math::min)
+        ENGINE_BINARY_LOOP(scalar_max, , math::max)
+
+#ifdef ENGINE_SIMD_X86
+        /*
+         * Векторный цикл по width значений и скалярный хвост.
+         * Атрибут target позволяет собрать AVX-версии без флагов компилятора
+         * для всего проекта: вызываются они только если CPUID их разрешил
+         * */
+#define ENGINE_VECTOR_BINARY(name, target_isa, width, load, store, vector_op, op)        \
+        __attribute__((target(target_isa)))                                               \
+        inline void name(const double *left, const double *right, double *out, size_t n) { \
+            size_t i = 0;                                                                  \
+            for (; i + width <= n; i += width)                                             \
+                store(out + i, vector_op(load(left + i), load(right + i)));               \
+            for (; i < n; i++)                                                             \
+                out[i] = left[i] op right[i];                                              \
+        }
+
+        ENGINE_VECTOR_BINARY(sse2_add, "sse2", 2, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd, +)
+        ENGINE_VECTOR_BINARY(sse2_sub, "sse2", 2, _mm_loadu_pd, _mm_storeu_pd, _mm_sub_pd, -)
+        ENGINE_VECTOR_BINARY(sse2_mul, "sse2", 2, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd, *)
+        ENGINE_VECTOR_BINARY(sse2_div, "sse2", 2, _mm_loadu_pd, _mm_storeu_pd, _mm_div_pd, /)
+
+        ENGINE_VECTOR_BINARY(avx2_add, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, +)
+        ENGINE_VECTOR_BINARY(avx2_sub, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd, -)
+        ENGINE_VECTOR_BINARY(avx2_mul, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd, *)
+        ENGINE_VECTOR_BINARY(avx2_div, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_div_pd, /)
+
+        ENGINE_VECTOR_BINARY(avx512_add, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_add_pd, +)
+        ENGINE_VECTOR_BINARY(avx512_sub, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_sub_pd, -)
+        ENGINE_VECTOR_BINARY(avx512_mul, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_mul_pd, *)
+        ENGINE_VECTOR_BINARY(avx512_div, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_div_pd, /)
+
+#undef ENGINE_VECTOR_BINARY
+
+#define ENGINE_VECTOR_UNARY(name, target_isa, width, load, store, vector_op, op) \
+        __attribute__((target(target_isa)))                                     \
+        inline void name(const double *in, double *out, size_t n) {             \
+            size_t i = 0;                                                       \
+            for (; i + width <= n; i += width)                                  \
+                store(out + i, vector_op(load(in + i)));                        \
+            for (; i < n; i++)                                                  \
+                out[i] = op(in[i]);                                             \
+        }
+
+        ENGINE_VECTOR_UNARY(sse2_sqrt, "sse2", 2, _mm_loadu_pd, _mm_storeu_pd, _mm_sqrt_pd, std::sqrt)
+        ENGINE_VECTOR_UNARY(avx2_sqrt, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sqrt_pd, std::sqrt)
+        ENGINE_VECTOR_UNARY(avx512_sqrt, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_sqrt_pd, std::sqrt)
+
+#undef ENGINE_VECTOR_UNARY
+
+        // Полиномы engine::math под SSE2 компилятор не векторизует, поэтому здесь тоже libm
+        ENGINE_UNARY_LOOP(sse2_abs, __attribute__((target("sse2"))), std::fabs)
+        ENGINE_UNARY_LOOP(sse2_floor, __attribute__((target("sse2"))), std::floor)
+        ENGINE_UNARY_LOOP(sse2_ceil, __attribute__((target("sse2"))), std::ceil)
+        ENGINE_UNARY_LOOP(sse2_exp, __attribute__((target("sse2"))), std::exp)
+        ENGINE_UNARY_LOOP(sse2_log, __attribute__((target("sse2"))), std::log)
+        ENGINE_UNARY_LOOP(sse2_sin, __attribute__((target("sse2"))), std::sin)
+        ENGINE_UNARY_LOOP(sse2_cos, __attribute__((target("sse2"))), std::cos)
+        ENGINE_BINARY_LOOP(sse2_min, __attribute__((target("sse2"))), math::min)
+        ENGINE_BINARY_LOOP(sse2_max, __attribute__((target("sse2"))), math::max)
+
+        // Есть ли аргумент, для которого приведения из engine::math не хватает
+        inline bool has_large_argument(const double *in, size_t n) {
+            bool large = false;
+            for (size_t i = 0; i < n; i++)
+                large |= std::fabs(in[i]) > math::trigonometric_limit;
+            return large;
+        }
+
+        // Большие аргументы редки: блок с ними целиком считается с проверкой границы
+#define ENGINE_TRIGONOMETRIC_LOOP(name, attributes, function, reduced) \
+        attributes inline void name(const double *in, double *out, size_t n) { \
+            if (has_large_argument(in, n)) {                             \
+                for (size_t i = 0; i < n; i++)                           \
+                    out[i] = function(in[i]);                            \
+                return;                                                  \
+            }                                                            \
+            for (size_t i = 0; i < n; i++)                               \
+                out[i] = reduced(in[i]);                                 \
+        }
+
+        // Полиномы без ветвлений: компилятор векторизует эти циклы под ширину target
+#define ENGINE_MATH_KERNELS(prefix, attributes)                                           \
+        ENGINE_UNARY_LOOP(prefix##_abs, attributes, std::fabs)                            \
+        ENGINE_UNARY_LOOP(prefix##_floor, attributes, math::floor)                        \
+        ENGINE_UNARY_LOOP(prefix##_ceil, attributes, math::ceil)                          \
+        ENGINE_UNARY_LOOP(prefix##_exp, attributes, math::exp)                            \
+        ENGINE_UNARY_LOOP(prefix##_log, attributes, math::log)                            \
+        ENGINE_TRIGONOMETRIC_LOOP(prefix##_sin, attributes, math::sin, math::sin_reduced) \
+        ENGINE_TRIGONOMETRIC_LOOP(prefix##_cos, attributes, math::cos, math::cos_reduced) \
+        ENGINE_BINARY_LOOP(prefix##_min, attributes, math::min)                           \
+        ENGINE_BINARY_LOOP(prefix##_max, attributes, math::max)
+
+        ENGINE_MATH_KERNELS(avx2, __attribute__((target("avx2"))))
+        ENGINE_MATH_KERNELS(avx512, __attribute__((target("avx512f"))))
+
+#undef ENGINE_MATH_KERNELS
+#undef ENGINE_TRIGONOMETRIC_LOOP
+
+        // Смена знака - xor со знаковым битом, как и у скалярного минуса
+        __attribute__((target("sse2")))
+        inline void sse2_neg(const double *in, double *out, size_t n) {
+            const __m128d sign = _mm_set1_pd(-0.0);
+            size_t i = 0;
+            for (; i + 2 <= n; i += 2)
+                _mm_storeu_pd(out + i, _mm_xor_pd(_mm_loadu_pd(in + i), sign));
+            for (; i < n; i++)
+                out[i] = -in[i];
+        }
+
+        __attribute__((target("avx2")))
+        inline void avx2_neg(const double *in, double *out, size_t n) {
+            const __m256d sign = _mm256_set1_pd(-0.0);
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4)
+                _mm256_storeu_pd(out + i, _mm256_xor_pd(_mm256_loadu_pd(in + i), sign));
+            for (; i < n; i++)
+                out[i] = -in[i];
+        }
+
+        // В AVX-512F нет xor для double, поэтому xor идет по целым
+        __attribute__((target("avx512f")))
+        inline void avx512_neg(const double *in, double *out, size_t n) {
+            const __m512i sign = _mm512_set1_epi64((long long) 0x8000000000000000ULL);
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8) {
+                __m512i value = _mm512_castpd_si512(_mm512_loadu_pd(in + i));
+                _mm512_storeu_pd(out + i, _mm512_castsi512_pd(_mm512_xor_si512(value, sign)));
+            }
+            for (; i < n; i++)
+                out[i] = -in[i];
+        }
+#endif
+
+#undef ENGINE_UNARY_LOOP
+#undef ENGINE_BINARY_LOOP
+    }
+
+    // Самый широкий набор инструкций, который есть у процессора и ОС
+    inline Isa detect() {
+#ifdef ENGINE_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return avx512;
+        if (__builtin_cpu_supports("avx2"))
+            return avx2;
+        return sse2;
+#else
+        return scalar;
+#endif
+    }
+
+#define ENGINE_MATH_TABLE(prefix)                                                              \
+        detail::prefix##_sqrt, detail::prefix##_abs, detail::prefix##_floor, detail::prefix##_ceil, \
+        detail::prefix##_exp, detail::prefix##_log, detail::prefix##_sin, detail::prefix##_cos,     \
+        detail::prefix##_min, detail::prefix##_max
+
+    // Ядра для заданного набора инструкций, неподдерживаемый заменяется скалярным
+    inline const Kernels &kernels_for(Isa isa) {
+        static const Kernels scalar_kernels = {
+                scalar, detail::scalar_add, detail::scalar_sub, detail::scalar_mul, detail::scalar_div,
+                detail::scalar_neg, ENGINE_MATH_TABLE(scalar)
+        };
+#ifdef ENGINE_SIMD_X86
+        static const Kernels sse2_kernels = {
+                sse2, detail::sse2_add, detail::sse2_sub, detail::sse2_mul, detail::sse2_div, detail::sse2_neg,
+                ENGINE_MATH_TABLE(sse2)
+        };
+        static const Kernels avx2_kernels = {
+                avx2, detail::avx2_add, detail::avx2_sub, detail::avx2_mul, detail::avx2_div, detail::avx2_neg,
+                ENGINE_MATH_TABLE(avx2)
+        };
+        static const Kernels avx512_kernels = {
+                avx512, detail::avx512_add, detail::avx512_sub, detail::avx512_mul, detail::avx512_div,
+                detail::avx512_neg, ENGINE_MATH_TABLE(avx512)
+        };
+
+        if (isa > detect())
+            return scalar_kernels;
+
+        switch (isa) {
+            case sse2:
+                return sse2_kernels;
+            case avx2:
+                return avx2_kernels;
+            case avx512:
+                return avx512_kernels;
+            default:
+                return scalar_kernels;
+        }
+#else
+        return scalar_kernels;
+#endif
+    }
+
+#undef ENGINE_MATH_TABLE
+
+    namespace detail {
+        inline const Kernels *&active() {
+            static const Kernels *kernels = &kernels_for(detect());
+            return kernels;
+        }
+    }
+
+    // Ядра, которыми сейчас пользуется пакетное вычисление
+    inline const Kernels &kernels() {
+        return *detail::active();
+    }
+
+    /*
+     * Принудительно выбирает набор инструкций (например, для сравнения в бенчмарке).
+     * Вызывать до начала вычислений, не из нескольких потоков сразу
+     * */
+    inline void use(Isa isa) {
+        detail::active() = &kernels_for(isa);
+    }
+}
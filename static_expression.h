@@ -0,0 +1,300 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "engine.h"
+
+
+/*
+ * Выражения, известные при компиляции: "a*b+c"_expr разбирает компилятор
+ * по той же грамматике, что и engine::Parser (operator_table, встроенные функции),
+ * и собирает из него дерево типов. Вычисление - встроенный код без нод, байткода и разбора.
+ * Переменные получают слоты по порядку появления, как у Parser без declare_variable.
+ * Ошибка в тексте выражения - ошибка компиляции. Нужен C++20
+ * */
+namespace engine {
+    // Текст выражения как параметр шаблона
+    template<size_t N>
+    struct ExpressionText {
+        char text[N] = {};
+
+        constexpr ExpressionText(const char (&source)[N]) {
+            for (size_t i = 0; i < N; i++)
+                text[i] = source[i];
+        }
+
+        constexpr std::string_view view() const {
+            return {text, N - 1};
+        }
+    };
+
+    namespace static_expression {
+        // Ноды дерева типов: eval() по значениям переменных, как у engine::Node
+        template<double Value>
+        struct Constant {
+            static double eval(const double *) {
+                return Value;
+            }
+        };
+
+        template<size_t Slot>
+        struct Variable {
+            static double eval(const double *variables) {
+                return variables[Slot];
+            }
+        };
+
+        template<Token Operation, typename Right>
+        struct Unary {
+            static double eval(const double *variables) {
+                return apply_unary(Operation, Right::eval(variables));
+            }
+        };
+
+        template<Token Operation, typename Left, typename Right>
+        struct Binary {
+            static double eval(const double *variables) {
+                double left = Left::eval(variables);
+                return apply_binary(Operation, left, Right::eval(variables));
+            }
+        };
+
+        // Index - номер в builtin_table, указатель на функцию известен компилятору
+        template<size_t Index, typename... Arguments>
+        struct Call {
+            static double eval(const double *variables) {
+                const double values[sizeof...(Arguments) + 1] = {Arguments::eval(variables)...};
+                return builtin_table[Index].scalar(nullptr, values);
+            }
+        };
+
+        // Нода разобранного при компиляции дерева, операнды - индексы в FlatTree::operands
+        struct FlatNode {
+            NodeType type = engine::number_node;
+            Token operation = engine::addition;
+            double number = 0;
+            // слот переменной или номер встроенной функции
+            size_t index = 0;
+            size_t first_operand = 0;
+            size_t operand_count = 0;
+        };
+
+        // Дерево в массивах: нод не больше, чем символов в тексте
+        template<size_t Capacity>
+        struct FlatTree {
+            std::array<FlatNode, Capacity> nodes = {};
+            std::array<size_t, Capacity> operands = {};
+            // имена переменных по слотам, указывают в текст выражения
+            std::array<std::string_view, Capacity> variables = {};
+            size_t node_count = 0;
+            size_t operand_total = 0;
+            size_t variable_count = 0;
+            size_t root = 0;
+        };
+
+        /*
+         * Разбор текста целиком по грамматике Parser: engine::parse_operators() в constexpr.
+         * Вызываются только встроенные функции
+         * */
+        template<typename Builder>
+        constexpr void parse(std::string_view text, Builder &builder) {
+            Tokenizer tokenizer;
+            tokenizer.set_input(text);
+            ParseState state;
+            parse_operators(tokenizer, builder, state);
+            if (tokenizer.current_token != engine::eof)
+                throw std::logic_error("Not understandable expression");
+        }
+
+        // Собирает FlatTree; имена переменных получают слоты по порядку появления
+        template<size_t Capacity>
+        struct TreeBuilder {
+            FlatTree<Capacity> tree;
+            // индексы нод, которые еще ждут родителя
+            std::vector<size_t> stack;
+
+            constexpr void number(double value) {
+                FlatNode node;
+                node.number = value;
+                push(node, 0);
+            }
+
+            constexpr void variable(std::string_view name) {
+                FlatNode node;
+                node.type = engine::variable_node;
+                node.index = tree.variable_count;
+                for (size_t slot = 0; slot < tree.variable_count; slot++) {
+                    if (tree.variables[slot] == name)
+                        node.index = slot;
+                }
+                if (node.index == tree.variable_count)
+                    tree.variables[tree.variable_count++] = name;
+                push(node, 0);
+            }
+
+            constexpr void operation(Token token, bool unary) {
+                FlatNode node;
+                node.type = unary ? engine::unary_operation_node : engine::binary_operation_node;
+                node.operation = token;
+                push(node, unary ? 1 : 2);
+            }
+
+            constexpr void call(const Function *function, size_t count) {
+                FlatNode node;
+                node.type = engine::call_node;
+                node.index = (size_t) (function - builtin_table.data());
+                push(node, count);
+            }
+
+            constexpr const Function *find_function(std::string_view name) const {
+                return find_builtin(name);
+            }
+
+            // новая нода забирает count верхних нод стека и кладется на их место
+            constexpr void push(FlatNode node, size_t count) {
+                node.first_operand = tree.operand_total;
+                node.operand_count = count;
+                for (size_t i = stack.size() - count; i < stack.size(); i++)
+                    tree.operands[tree.operand_total++] = stack[i];
+                stack.resize(stack.size() - count);
+                tree.nodes[tree.node_count] = node;
+                stack.push_back(tree.node_count++);
+            }
+        };
+
+        template<size_t Capacity>
+        constexpr FlatTree<Capacity> parse_tree(std::string_view text) {
+            TreeBuilder<Capacity> builder;
+            parse(text, builder);
+            builder.tree.root = builder.stack.back();
+            return builder.tree;
+        }
+
+        // Считает выражение прямо при разборе, без дерева
+        struct ConstantBuilder {
+            std::vector<double> values;
+
+            constexpr void number(double value) {
+                values.push_back(value);
+            }
+
+            // не constexpr: переменная в тексте при компиляции - ошибка компиляции
+            void variable(std::string_view) {
+                throw std::logic_error("Constant expression can not use variables");
+            }
+
+            constexpr void operation(Token token, bool unary) {
+                double right = values.back();
+                if (unary) {
+                    values.back() = apply_unary(token, right);
+                    return;
+                }
+                values.pop_back();
+                values.back() = apply_binary(token, values.back(), right);
+            }
+
+            // встроенные функции зовут libm, она не constexpr: вызовы считаются только в рантайме
+            void call(const Function *function, size_t count) {
+                double arguments[max_arguments] = {};
+                for (size_t i = 0; i < count; i++)
+                    arguments[i] = values[values.size() - count + i];
+                values.resize(values.size() - count);
+                values.push_back(function->call(arguments));
+            }
+
+            constexpr const Function *find_function(std::string_view name) const {
+                return find_builtin(name);
+            }
+        };
+
+        template<ExpressionText Text>
+        struct Parsed {
+            static constexpr auto tree = parse_tree<sizeof(Text.text)>(Text.view());
+        };
+
+        // Тип ноды Index дерева Tree
+        template<const auto &Tree, size_t Index>
+        constexpr auto build() {
+            constexpr const FlatNode &node = Tree.nodes[Index];
+            if constexpr (node.type == engine::number_node) {
+                return Constant<node.number>();
+            } else if constexpr (node.type == engine::variable_node) {
+                return Variable<node.index>();
+            } else if constexpr (node.type == engine::unary_operation_node) {
+                using Right = decltype(build<Tree, Tree.operands[node.first_operand]>());
+                return Unary<node.operation, Right>();
+            } else if constexpr (node.type == engine::binary_operation_node) {
+                using Left = decltype(build<Tree, Tree.operands[node.first_operand]>());
+                using Right = decltype(build<Tree, Tree.operands[node.first_operand + 1]>());
+                return Binary<node.operation, Left, Right>();
+            } else {
+                return []<size_t... Indices>(std::index_sequence<Indices...>) {
+                    constexpr const FlatNode &call = Tree.nodes[Index];
+                    return Call<call.index, decltype(build<Tree, Tree.operands[call.first_operand + Indices]>())...>();
+                }(std::make_index_sequence<Tree.nodes[Index].operand_count>());
+            }
+        }
+    }
+
+    /*
+     * Выражение, разобранное при компиляции. Результат совпадает с Parser и Program
+     * для того же текста: операции считаются теми же apply_binary и apply_unary
+     * */
+    template<ExpressionText Text>
+    class StaticExpression {
+        static constexpr const auto &tree = static_expression::Parsed<Text>::tree;
+
+    public:
+        using Tree = decltype(static_expression::build<static_expression::Parsed<Text>::tree, tree.root>());
+
+        static constexpr size_t variable_count = tree.variable_count;
+
+        // имена переменных по слотам
+        static constexpr auto variables = [] {
+            std::array<std::string_view, variable_count> names = {};
+            for (size_t slot = 0; slot < variable_count; slot++)
+                names[slot] = tree.variables[slot];
+            return names;
+        }();
+
+        // variables - значения переменных по их слотам
+        static double eval(const double *variables) {
+            return Tree::eval(variables);
+        }
+
+        // Значения переменных по порядку слотов
+        template<typename... Values>
+        double operator()(Values... values) const {
+            static_assert(sizeof...(Values) == variable_count, "Wrong number of variable values");
+            const double slots[sizeof...(Values) + 1] = {(double) values...};
+            return Tree::eval(slots);
+        }
+    };
+
+    /*
+     * Значение выражения без переменных. Можно звать при компиляции:
+     * constexpr double day = engine::evaluate_constant("60 * 60 * 24");
+     * тогда ошибка в тексте - ошибка компиляции, а разбора при запуске нет.
+     * Результат совпадает с Parser::answer. Вызовы функций (sin, exp...) считаются
+     * только в рантайме, как и степени, кроме целых от 0 до 16: x^0.5, дробные
+     * и отрицательные показатели идут в std::sqrt и std::pow, а они не constexpr
+     * */
+    constexpr double evaluate_constant(std::string_view text) {
+        static_expression::ConstantBuilder builder;
+        static_expression::parse(text, builder);
+        return builder.values.back();
+    }
+
+    namespace literals {
+        // "a*b+c"_expr - StaticExpression для этого текста
+        template<ExpressionText Text>
+        constexpr StaticExpression<Text> operator ""_expr() {
+            return {};
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "cache.h"
+
+
+static int failures = 0;
+
+static void check(bool condition, const char *what) {
+    if (!condition) {
+        std::printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+static bool same(const engine::ExpressionCache::Statistics &statistics, size_t hits, size_t misses, size_t evictions) {
+    return statistics.hits == hits && statistics.misses == misses && statistics.evictions == evictions;
+}
+
+static void test_counters() {
+    engine::ExpressionCache cache(2);
+
+    auto first = cache.get("1 + x");
+    check(same(cache.statistics(), 0, 1, 0), "first get is a miss");
+    check(first->program.eval(std::vector<double>{2}) == 3, "1+x at x=2");
+
+    // тот же текст без пробелов - тот же ключ
+    auto again = cache.get("1+x");
+    check(again == first, "normalized text hits the same entry");
+    check(same(cache.statistics(), 1, 1, 0), "second get is a hit");
+
+    cache.get("2*y");
+    check(same(cache.statistics(), 1, 2, 0), "new text is a miss");
+    check(cache.size() == 2, "two entries");
+
+    // "1+x" использовался раньше "2*y", вытесняется он
+    cache.get("y-1");
+    check(same(cache.statistics(), 1, 3, 1), "third entry evicts one");
+    check(cache.size() == 2, "size stays at capacity");
+
+    cache.get("2*y");
+    check(same(cache.statistics(), 2, 3, 1), "recent entry survives");
+    cache.get("1+x");
+    check(same(cache.statistics(), 2, 4, 2), "least recent entry is evicted");
+}
+
+static void test_normalize() {
+    check(engine::ExpressionCache::normalize("  1 +  x ") == "1+x", "spaces around operators are dropped");
+    check(engine::ExpressionCache::normalize("1 2") == "1 2", "space between numbers stays");
+    check(engine::ExpressionCache::normalize("a < = b") == "a< =b", "space inside <= stays");
+}
+
+static void test_long_formula() {
+    // разбор, оптимизация и компиляция не должны упираться в стек вызовов
+    std::string text = "1";
+    for (size_t i = 0; i < 2000000; i++)
+        text += "+x";
+
+    engine::ExpressionCache cache(1);
+    auto compiled = cache.get(text);
+    check(compiled->program.eval(std::vector<double>{0.5}) == 1000001, "long flat sum");
+
+    std::string nested = std::string(1000000, '(') + "x" + std::string(1000000, ')');
+    compiled = cache.get(nested);
+    check(compiled->program.eval(std::vector<double>{7}) == 7, "deep parentheses");
+    check(same(cache.statistics(), 0, 2, 1), "long formulas are cached like short ones");
+}
+
+int main() {
+    test_counters();
+    test_normalize();
+    test_long_formula();
+
+    if (failures == 0)
+        std::printf("cache: ok\n");
+    return failures == 0 ? 0 : 1;
+}
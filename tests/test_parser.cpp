@@ -0,0 +1,310 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include "engine.h"
+#include "incremental.h"
+#include "optimize.h"
+#include "program.h"
+#include "static_expression.h"
+
+using namespace engine::literals;
+
+
+static int failures = 0;
+
+static void check(bool condition, const char *what) {
+    if (!condition) {
+        std::printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// Разбирает text и сверяет результат дерева, Evaluator и Program после оптимизации
+static void check_value(const std::string &text, double variable, double expected, const char *what) {
+    engine::Tokenizer tokenizer;
+    engine::Parser parser(&tokenizer);
+    tokenizer.set_input(text);
+    auto expression = parser.parse_expression();
+
+    check(expression.eval(&variable) == expected, what);
+    engine::optimize(expression);
+    check(expression.eval(&variable) == expected, what);
+    check(engine::Program(expression).eval(&variable) == expected, what);
+}
+
+/*
+ * Глубина вложенности ограничена памятью, а не стеком вызовов:
+ * разбор, оптимизация и вычисление обходят дерево с явными стеками
+ * */
+static void test_deep_nesting() {
+    const size_t depth = 1000000;
+
+    check_value(std::string(depth, '(') + "x" + std::string(depth, ')'), 3, 3, "1M nested parentheses");
+    check_value(std::string(depth, '-') + "x", 3, 3, "1M unary minuses");
+
+    std::string sum = "1";
+    for (size_t i = 0; i < depth; i++)
+        sum += "+x";
+    check_value(sum, 0.5, 500001, "1M-term flat sum");
+
+    std::string power = "x";
+    for (size_t i = 0; i < depth; i++)
+        power += "^1";
+    check_value(power, 5, 5, "1M-deep right-associative power");
+}
+
+static bool same(double left, double right) {
+    // до бита, включая знак нуля; NaN равны друг другу
+    return std::memcmp(&left, &right, sizeof(double)) == 0 || (left != left && right != right);
+}
+
+/*
+ * "..."_expr должен давать то же, что Parser для того же текста:
+ * те же слоты переменных в том же порядке и те же значения до бита
+ * */
+template<typename Static>
+static void check_static(Static formula, std::string_view text) {
+    engine::Tokenizer tokenizer;
+    engine::Parser parser(&tokenizer);
+    tokenizer.set_input(text);
+    auto expression = parser.parse_expression();
+
+    bool slots = parser.variables.size() == formula.variable_count;
+    for (size_t slot = 0; slots && slot < formula.variable_count; slot++)
+        slots = parser.variables[slot] == formula.variables[slot];
+    if (!slots) {
+        std::printf("FAILED: variable slots of %s\n", text.data());
+        failures++;
+        return;
+    }
+
+    const double samples[] = {0.0, -0.0, 1.0, -1.0, 2.5, -3.75, 0.5, 1e300, -1e-300};
+    const size_t sample_count = sizeof(samples) / sizeof(samples[0]);
+    double values[4] = {};
+    for (size_t row = 0; row < sample_count * sample_count; row++) {
+        // первые две переменные пробегают все пары, остальные сдвинуты относительно них
+        size_t index = row;
+        for (size_t slot = 0; slot < formula.variable_count; slot++) {
+            values[slot] = samples[(index + slot * 3) % sample_count];
+            index /= sample_count;
+        }
+        if (!same(formula.eval(values), expression.eval(values))) {
+            std::printf("FAILED: %s differs from Parser at row %zu\n", text.data(), row);
+            failures++;
+            return;
+        }
+    }
+}
+
+#define CHECK_STATIC(text) check_static(text##_expr, text)
+
+static void test_static_parity() {
+    // приоритеты и ассоциативность
+    CHECK_STATIC("a+b*c-a/b");
+    CHECK_STATIC("a-b-c");
+    CHECK_STATIC("a/b/c");
+    CHECK_STATIC("a^b^c");
+    CHECK_STATIC("a%b+a//b");
+    CHECK_STATIC("(a+b)*(a-b)");
+    CHECK_STATIC("a<b+(a>=b)*2+(a==b)-(a!=b)+(a<=c)+(b>c)");
+
+    // унарный минус: слабее степени, сильнее остальных операций
+    CHECK_STATIC("-a^2");
+    CHECK_STATIC("--a");
+    CHECK_STATIC("-a*-b");
+    CHECK_STATIC("a^-b");
+    CHECK_STATIC("-(a+b)^-2");
+
+    // сокращенные степени и вызовы функций
+    CHECK_STATIC("a^2+a^3+a^0.5+a^7+a^-2+a^0");
+    CHECK_STATIC("max(a,b)*sqrt(abs(c))-min(-a,floor(b))");
+    CHECK_STATIC("exp(-a*b)+cos(sin(c))");
+
+    // слоты - в порядке первого появления, повтор не заводит новый слот
+    CHECK_STATIC("c*b+a*c");
+    CHECK_STATIC("zeta+alpha-zeta*beta");
+    CHECK_STATIC("2*3+4^0.5");
+}
+
+// Числа вне диапазона double - inf и 0, одинаково у Parser и при разборе во время компиляции
+static void test_number_range() {
+    constexpr double huge_constant = engine::evaluate_constant("1" + std::string(400, '0'));
+    constexpr double tiny_constant = engine::evaluate_constant("0." + std::string(400, '0') + "1");
+    check(huge_constant == INFINITY && tiny_constant == 0, "out-of-range numbers at compile time");
+
+    check_value("1" + std::string(400, '0'), 0, INFINITY, "number above the double range is inf");
+    check_value("0." + std::string(400, '0') + "1", 0, 0, "number below the double range is 0");
+}
+
+// Текст ошибки Parser для text, пустой - если текст разбирается
+static std::string parser_error(const std::string &text) {
+    engine::Tokenizer tokenizer;
+    engine::Parser parser(&tokenizer);
+    try {
+        tokenizer.set_input(text);
+        parser.parse_expression();
+    } catch (const std::logic_error &error) {
+        return error.what();
+    }
+    return "";
+}
+
+// Правит incremental и сверяет с Parser на новом тексте: ту же ошибку или то же значение до бита
+static void check_edit(engine::IncrementalParser &incremental, size_t offset, size_t removed, std::string_view inserted) {
+    std::string text = incremental.text();
+    text.replace(offset, removed, inserted);
+
+    std::string error;
+    try {
+        incremental.edit(offset, removed, inserted);
+    } catch (const std::logic_error &exception) {
+        error = exception.what();
+    }
+    if (error != parser_error(text)) {
+        std::printf("FAILED: error of %s: \"%s\" instead of \"%s\"\n", text.c_str(), error.c_str(),
+                    parser_error(text).c_str());
+        failures++;
+        return;
+    }
+    if (!error.empty())
+        return;
+
+    engine::Tokenizer tokenizer;
+    engine::Parser parser(&tokenizer);
+    tokenizer.set_input(text);
+    auto expression = parser.parse_expression();
+    // значения по именам: слоты у incremental свои
+    std::vector<double> values;
+    for (const auto &name : incremental.variables())
+        values.push_back((double) name.size() + 0.25);
+    std::vector<double> reference;
+    for (const auto &name : parser.variables)
+        reference.push_back((double) name.size() + 0.25);
+    if (!same(incremental.eval(values.data()), expression.eval(reference.data()))) {
+        std::printf("FAILED: value of %s differs from Parser\n", text.c_str());
+        failures++;
+    }
+}
+
+static void test_incremental() {
+    engine::Tokenizer tokenizer;
+    engine::Parser parser(&tokenizer);
+    engine::IncrementalParser incremental(&parser);
+
+    // набор по буквам: слоты промежуточных имен освобождаются
+    incremental.set_text("1");
+    for (char letter : std::string_view("+price"))
+        check_edit(incremental, incremental.text().size(), 0, std::string(1, letter));
+    check(incremental.variable_count() == 1 && incremental.variables()[0] == "price", "slot of a typed name");
+    check_edit(incremental, 2, 5, "");
+    for (char letter : std::string_view("sqrt(4)"))
+        check_edit(incremental, incremental.text().size(), 0, std::string(1, letter));
+    check(incremental.variable_count() == 0, "function name keeps no slot");
+
+    // ошибки - как у Parser
+    const char *broken[] = {"1+", "(1+2", "1+2)", "2 3", "2(3)", "f(1)", "max(1)", "sin()", "()", "1,2", "1+$", "x y",
+                            "((1)", "(1))+(", "(1+$", "max(1=2", "(2)!", "(\xc3\xa9)", "f((1)"};
+    for (const char *text : broken) {
+        incremental.set_text("1+2");
+        check_edit(incremental, 0, 3, text);
+        check_edit(incremental, 0, incremental.text().size(), "1+2");
+    }
+
+    // длинный плоский уровень: правка продолжает разбор с сохраненного состояния
+    std::string level = "x";
+    const char *operators[] = {"+", "*", "-", "^", "/", "<"};
+    for (size_t i = 0; i < 2000; i++)
+        level += std::string(operators[i % 6]) + (i % 7 == 0 ? "(y-" + std::to_string(i % 10) + ")" : std::to_string(i % 10));
+    incremental.set_text(level);
+    for (size_t offset = 5; offset < level.size(); offset += 97) {
+        size_t digit = incremental.text().find_first_of("0123456789", offset);
+        check_edit(incremental, digit, 1, "7");
+        check_edit(incremental, digit + 1, 0, "*z+3");
+        check_edit(incremental, digit, 5, "-");
+        check_edit(incremental, digit, 1, "8^");
+    }
+
+    // вторая правка сходится на состоянии, с которого продолжался разбор первой
+    const char *shifted = "-y*6+6-y+1+(1)*(6)*(4)/5/y+max(x,2)^4/(x)/y*max(x,2)+max(x,2)-(0)-y/(5)/max(x,2)*max(x,2)"
+                          "-y*(4)-(8)^5*(8)-(8)*y*(0)+(0)";
+    incremental.set_text(shifted);
+    check_edit(incremental, 25, 2, " ");
+    check_edit(incremental, 4, 2, "3.5 ");
+
+    // долгая история правок одного парсера: операнды вставляются, удаляются и меняются;
+    // правку, которая ломает текст, делаем изредка и следующей отменяем
+    const char *terms[] = {"y", "x", "3.5", "(4)", "max(x,2)", "y/(5)", "(8)^5", "-(0)", "(x+1)*y"};
+    const char *pieces[] = {" ", "+", "*(", ")", "max(", "2,", "y 2"};
+    std::string_view signs = "+-*/^";
+    std::minstd_rand random(1);
+    incremental.set_text(shifted);
+    for (int i = 0; i < 3000; i++) {
+        std::string text = incremental.text();
+        size_t offset = random() % (text.size() + 1);
+        size_t next = std::min(text.find_first_of(signs, offset), text.size());
+        size_t removed = 0;
+        std::string inserted;
+        // в длинный текст операнды не вставляются
+        switch (random() % 4 + (text.size() > 400)) {
+            case 0:
+                offset = next;
+                inserted = signs[random() % signs.size()] + std::string(terms[random() % std::size(terms)]);
+                break;
+            case 1:
+            case 4:
+                offset = next;
+                removed = std::min(text.find_first_of(signs, offset + 1), text.size()) - offset;
+                break;
+            case 2:
+                offset = std::min(text.find_first_of("0123456789", offset), text.size());
+                removed = offset < text.size();
+                inserted = std::to_string(random() % 20);
+                break;
+            default:
+                removed = std::min<size_t>(random() % 3, text.size() - offset);
+                inserted = pieces[random() % std::size(pieces)];
+        }
+        std::string erased = text.substr(offset, removed);
+
+        bool breaks = !parser_error(text.replace(offset, removed, inserted)).empty();
+        if (breaks && random() % 10 != 0)
+            continue;
+        check_edit(incremental, offset, removed, inserted);
+        if (breaks)
+            check_edit(incremental, offset, inserted.size(), erased);
+    }
+
+    // вызов набирается посреди длинного уровня: до ')' скобки не сходятся
+    incremental.set_text(level);
+    size_t typed = level.find('+', level.size() / 2) + 1;
+    for (char letter : std::string_view("max(2, x=")) {
+        check_edit(incremental, typed, 0, std::string(1, letter));
+        typed++;
+    }
+    check_edit(incremental, typed, 0, "=");
+    typed++;
+    for (char letter : std::string_view("3, 4^(y-1) )*")) {
+        check_edit(incremental, typed, 0, std::string(1, letter));
+        typed++;
+    }
+    check_edit(incremental, 7, 0, ")");
+    check_edit(incremental, 7, 1, "");
+}
+
+int main() {
+    test_deep_nesting();
+    test_static_parity();
+    test_number_range();
+    test_incremental();
+
+    if (failures == 0)
+        std::printf("parser: ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+
+/*
+ * Элементарные функции без ветвлений и без вызовов libm.
+ * Особые случаи (NaN, бесконечности, ноль) разбираются выбором значения, а не переходом,
+ * поэтому цикл по массиву с этими функциями компилятор векторизует.
+ * Выбор значения - detail::select по битовой маске: из обычного ?: компилятор
+ * переносит арифметику в ветку (она может выставить флаги FP-исключений) и оставляет переход.
+ * Точность - около 1 ulp, как у fdlibm, из которой взяты полиномы
+ * */
+namespace engine::math {
+    namespace detail {
+        inline uint64_t bits(double value) {
+            uint64_t result;
+            std::memcpy(&result, &value, sizeof(result));
+            return result;
+        }
+
+        inline double from_bits(uint64_t value) {
+            double result;
+            std::memcpy(&result, &value, sizeof(result));
+            return result;
+        }
+
+        // x + round_magic - round_magic округляет x до целого, младшие биты суммы - само целое
+        constexpr double round_magic = 0x1.8p52;
+
+        // 2^n для нормальных степеней, -1022 <= n <= 1023; n в дополнительном коде
+        inline double exp2_integer(uint64_t n) {
+            return from_bits((n + 1023) << 52);
+        }
+
+        constexpr double ln2_hi = 6.93147180369123816490e-01;
+        constexpr double ln2_lo = 1.90821492927058770002e-10;
+
+        // sin(r) и cos(r) для |r| <= pi/4, полиномы __kernel_sin и __kernel_cos из fdlibm
+        inline double sin_polynomial(double r) {
+            double z = r * r;
+            double tail = 8.33333333332248946124e-03 + z * (-1.98412698298579493134e-04 + z * (
+                    2.75573137070700676789e-06 + z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10)));
+            return r + z * r * (-1.66666666666666324348e-01 + z * tail);
+        }
+
+        inline double cos_polynomial(double r) {
+            double z = r * r;
+            double tail = z * (4.16666666666666019037e-02 + z * (-1.38888888888741095749e-03 + z * (
+                    2.48015872894767294178e-05 + z * (-2.75573143513906633035e-07 + z * (
+                    2.08757232129817482790e-09 + z * -1.13596475577881948265e-11)))));
+            double half = 0.5 * z;
+            double w = 1 - half;
+            return w + (((1 - w) - half) + z * tail);
+        }
+
+        /*
+         * Приведение к |r| <= pi/4 и номер четверти: pi/2 разбита на три части по 33 бита,
+         * произведения на номер четверти точные, пока он меньше 2^20
+         * */
+        inline double reduce_quadrant(double x, uint64_t &quadrant) {
+            double shifted = x * 6.36619772367581382433e-01 + round_magic;
+            quadrant = bits(shifted);
+            double q = shifted - round_magic;
+            return ((x - q * 1.57079632673412561417e+00) - q * 6.07710050630396597660e-11)
+                   - q * 2.02226624871116645580e-21;
+        }
+
+        // Знаковый бит, если четверть quadrant меняет знак результата
+        inline uint64_t quadrant_sign(uint64_t quadrant) {
+            return (quadrant & 2) << 62;
+        }
+
+        // condition ? when_true : when_false без перехода
+        inline double select(bool condition, double when_true, double when_false) {
+            uint64_t mask = 0 - (uint64_t) condition;
+            return from_bits((bits(when_true) & mask) | (bits(when_false) & ~mask));
+        }
+
+        // odd, если младший бит quadrant единичный, иначе even
+        inline double select_odd(uint64_t quadrant, double odd, double even) {
+            uint64_t mask = 0 - (quadrant & 1);
+            return from_bits((bits(odd) & mask) | (bits(even) & ~mask));
+        }
+    }
+
+    // За этой границей приведение аргумента неточное, sin и cos считает libm
+    constexpr double trigonometric_limit = 0x1p19;
+
+    inline double exp(double x) {
+        // за границами результат все равно 0 или бесконечность
+        x = detail::select(x > 710, 710, x);
+        x = detail::select(x < -746, -746, x);
+
+        double shifted = x * 1.44269504088896338700e+00 + detail::round_magic;
+        // для NaN n - мусор, поэтому вся целая арифметика беззнаковая
+        uint64_t n = detail::bits(shifted) - detail::bits(detail::round_magic);
+        double k = shifted - detail::round_magic;
+        double r = (x - k * detail::ln2_hi) - k * detail::ln2_lo;
+
+        // ряд Тейлора до r^13, |r| <= ln2 / 2
+        double p = 1.0 / 6227020800;
+        p = p * r + 1.0 / 479001600;
+        p = p * r + 1.0 / 39916800;
+        p = p * r + 1.0 / 3628800;
+        p = p * r + 1.0 / 362880;
+        p = p * r + 1.0 / 40320;
+        p = p * r + 1.0 / 5040;
+        p = p * r + 1.0 / 720;
+        p = p * r + 1.0 / 120;
+        p = p * r + 1.0 / 24;
+        p = p * r + 1.0 / 6;
+        p = p * r + 0.5;
+        p = p * r + 1;
+        p = p * r + 1;
+
+        // 2^n двумя множителями: так не переполняются ни 2^1024, ни денормализованные степени.
+        // Половина считается сдвигом неотрицательного числа, знакового сдвига 64-битных целых нет до AVX-512
+        uint64_t half = ((n + 2048) >> 1) - 1024;
+        return p * detail::exp2_integer(half) * detail::exp2_integer(n - half);
+    }
+
+    inline double log(double x) {
+        // денормализованные числа сначала умножаются на 2^54
+        bool tiny = x < 0x1p-1022;
+        double scaled = x * detail::select(tiny, 0x1p54, 1);
+        uint64_t bits = detail::bits(scaled);
+
+        // x = m * 2^e, m в [sqrt(2) / 2, sqrt(2))
+        double m = detail::from_bits((bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL);
+        double e = detail::from_bits(0x4330000000000000ULL | (bits >> 52)) - (0x1p52 + 1023);
+        e -= detail::select(tiny, 54, 0);
+        bool big = m > 1.41421356237309504880;
+        m *= detail::select(big, 0.5, 1);
+        e += detail::select(big, 1, 0);
+
+        // log(1 + f) = 2 atanh(s), полином __ieee754_log из fdlibm
+        double f = m - 1;
+        double half_square = 0.5 * f * f;
+        double s = f / (2 + f);
+        double z = s * s;
+        double w = z * z;
+        double odd = w * (3.999999999940941908e-01 + w * (2.222219843214978396e-01 + w * 1.531383769920937332e-01));
+        double even = z * (6.666666666666735130e-01 + w * (2.857142874366239149e-01 + w * (
+                1.818357216161805012e-01 + w * 1.479819860511658591e-01)));
+        double result = e * detail::ln2_hi
+                        - ((half_square - (s * (half_square + odd + even) + e * detail::ln2_lo)) - f);
+
+        result = detail::select(x == std::numeric_limits<double>::infinity(), x, result);
+        result = detail::select(x == 0, -std::numeric_limits<double>::infinity(), result);
+        result = detail::select(x < 0, std::numeric_limits<double>::quiet_NaN(), result);
+        return detail::select(x != x, x, result);
+    }
+
+    // sin и cos без проверки границы, |x| <= trigonometric_limit
+    inline double sin_reduced(double x) {
+        uint64_t quadrant;
+        double r = detail::reduce_quadrant(x, quadrant);
+        double value = detail::select_odd(quadrant, detail::cos_polynomial(r), detail::sin_polynomial(r));
+        value = detail::from_bits(detail::bits(value) ^ detail::quadrant_sign(quadrant));
+        // полином теряет знак нуля
+        return detail::select(x == 0, x, value);
+    }
+
+    inline double cos_reduced(double x) {
+        uint64_t quadrant;
+        double r = detail::reduce_quadrant(x, quadrant);
+        double value = detail::select_odd(quadrant, detail::sin_polynomial(r), detail::cos_polynomial(r));
+        return detail::from_bits(detail::bits(value) ^ detail::quadrant_sign(quadrant + 1));
+    }
+
+    inline double sin(double x) {
+        return std::fabs(x) > trigonometric_limit ? std::sin(x) : sin_reduced(x);
+    }
+
+    inline double cos(double x) {
+        return std::fabs(x) > trigonometric_limit ? std::cos(x) : cos_reduced(x);
+    }
+
+    // Округление сложением с 2^52 того же знака: совпадает с std::floor, включая -0
+    inline double floor(double x) {
+        double magic = std::copysign(0x1p52, x);
+        double rounded = (x + magic) - magic;
+        rounded -= detail::select(rounded > x, 1, 0);
+        rounded = std::copysign(rounded, x);
+        return detail::select((std::fabs(x) >= 0x1p52) | (x != x), x, rounded);
+    }
+
+    inline double ceil(double x) {
+        double magic = std::copysign(0x1p52, x);
+        double rounded = (x + magic) - magic;
+        rounded += detail::select(rounded < x, 1, 0);
+        rounded = std::copysign(rounded, x);
+        return detail::select((std::fabs(x) >= 0x1p52) | (x != x), x, rounded);
+    }
+
+    // NaN в любом аргументе дает NaN, как и арифметика
+    inline double min(double a, double b) {
+        return detail::select((a < b) | (a != a), a, b);
+    }
+
+    inline double max(double a, double b) {
+        return detail::select((a > b) | (a != a), a, b);
+    }
+}